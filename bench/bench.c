@@ -0,0 +1,430 @@
+// Benchmarks for table stepping and for the regex engines. Every
+// measurement is one JSON object per line, so runs can be saved and
+// compared across versions:
+//
+//   ./nob bench [filter] [megabytes] > results.jsonl
+//
+// Only benchmarks whose name contains `filter` run. Throughput is the best
+// of BENCH_REPEAT runs. bytes_per_cycle counts TSC cycles, which tick at a
+// fixed rate and not at the core clock, and is null where there is no TSC.
+#define _POSIX_C_SOURCE 200809L
+#define REGEX_NO_MAIN
+#include "../examples/regex.c"
+
+#include <time.h>
+
+#define BENCH_REPEAT 3
+
+typedef struct {
+  const char *name;
+  size_t bytes;
+  uint64_t ns;
+  uint64_t cycles;
+  uint64_t compile_ns;
+  size_t table_bytes;
+  size_t shuffle_bytes;
+  size_t states;
+  size_t matches;
+} bench_result_t;
+
+const char *bench_filter = "";
+volatile fsm_state_t bench_sink; // Keeps runs whose result is unused from being optimized out
+
+uint64_t bench_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+uint64_t bench_cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_ia32_rdtsc();
+#else
+  return 0;
+#endif
+}
+
+uint64_t bench_random(uint64_t *seed) {
+  *seed ^= *seed << 13;
+  *seed ^= *seed >> 7;
+  *seed ^= *seed << 17;
+  return *seed;
+}
+
+bool bench_enabled(const char *name) {
+  return strstr(name, bench_filter) != NULL;
+}
+
+void bench_print_string(const char *s) {
+  putchar('"');
+  for (; *s; ++s) {
+    if (*s == '"' || *s == '\\') printf("\\%c", *s);
+    else if ((uint8_t)*s < 0x20) printf("\\u%04x", *s);
+    else putchar(*s);
+  }
+  putchar('"');
+}
+
+void bench_print(bench_result_t result) {
+  printf("{\"name\": ");
+  bench_print_string(result.name);
+  printf(", \"bytes\": %zu", result.bytes);
+  if (result.bytes > 0) {
+    printf(", \"ns_per_byte\": %.4f", (double)result.ns / result.bytes);
+    if (result.cycles > 0) printf(", \"bytes_per_cycle\": %.4f", (double)result.bytes / result.cycles);
+    else printf(", \"bytes_per_cycle\": null");
+  }
+  printf(", \"compile_ns\": %llu, \"table_bytes\": %zu, \"shuffle_bytes\": %zu, \"states\": %zu, \"matches\": %zu}\n",
+         (unsigned long long)result.compile_ns, result.table_bytes, result.shuffle_bytes, result.states, result.matches);
+  fflush(stdout);
+}
+
+// The shuffle rows are a second copy that only the SIMD walk reads, so they
+// are reported apart from the table itself
+void bench_table(bench_result_t *result, fsm_t fsm) {
+  result->shuffle_bytes = fsm.shuffle ? 256*(size_t)fsm.shuffle_width : 0;
+  result->table_bytes = fsm.block_size - result->shuffle_bytes;
+}
+
+// Runs `body` BENCH_REPEAT times after one warm-up and keeps the fastest
+#define BENCH_MEASURE(result, body)                                     \
+  do {                                                                  \
+    body;                                                               \
+    (result).ns = UINT64_MAX;                                           \
+    for (int repeat = 0; repeat < BENCH_REPEAT; ++repeat) {             \
+      uint64_t ns = bench_now(), cycles = bench_cycles();               \
+      body;                                                             \
+      cycles = bench_cycles() - cycles;                                 \
+      ns = bench_now() - ns;                                            \
+      if (ns < (result).ns) {                                           \
+        (result).ns = ns;                                               \
+        (result).cycles = cycles;                                       \
+      }                                                                 \
+    }                                                                   \
+  } while (0)
+
+// Random DFAs. Every transition goes to a random state, so the input
+// decides nothing and the numbers only reflect how fast the table can be
+// walked at that size.
+typedef struct {
+  size_t states;
+  size_t events;
+} bench_shape_t;
+
+const bench_shape_t bench_shapes[] = {
+  { 16, 16 },
+  { 256, 64 },
+  { 256, 256 },
+  { 4096, 256 },
+  { 65536, 256 },
+};
+
+void bench_random_dfas(size_t size) {
+  uint8_t *input = malloc(size);
+  assert(input && "Buy more RAM lol");
+  for (size_t s = 0; s < sizeof(bench_shapes)/sizeof(bench_shapes[0]); ++s) {
+    bench_shape_t shape = bench_shapes[s];
+    char name[128];
+    snprintf(name, sizeof(name), "dfa/%zux%zu", shape.states, shape.events);
+    if (!bench_enabled(name)) continue;
+
+    // Uniform over the whole alphabet, so every column of the table is read
+    uint64_t seed = 0x2545F4914F6CDD1DULL ^ shape.events;
+    for (size_t i = 0; i < size; ++i) input[i] = (uint8_t)(bench_random(&seed) % shape.events);
+    seed = 0x9E3779B97F4A7C15ULL ^ shape.states ^ shape.events << 32;
+
+    bench_result_t result = { .bytes = size, .states = shape.states };
+    uint64_t start = bench_now();
+    fsm_t fsm = {0};
+    fsm_init(&fsm, shape.events);
+    bool reserved = fsm_reserve(&fsm, shape.states);
+    assert(reserved && "Buy more RAM lol");
+    (void)reserved;
+    for (size_t i = 0; i < shape.states; ++i) (void)fsm_push_empty(&fsm);
+    for (fsm_state_t state = 0; state < shape.states; ++state) {
+      for (fsm_event_t event = 0; event < shape.events; ++event) {
+        fsm_set(&fsm, state, event, (fsm_state_t)(bench_random(&seed) % shape.states));
+      }
+    }
+    result.compile_ns = bench_now() - start;
+    bench_table(&result, fsm);
+
+    char variant[160];
+    snprintf(variant, sizeof(variant), "%s/mutable", name);
+    result.name = variant;
+    BENCH_MEASURE(result, { fsm.state = 0; bench_sink = fsm_run_bytes(&fsm, input, size).state; });
+    bench_print(result);
+
+    start = bench_now();
+    (void)fsm_compress_events(&fsm);
+    bool compacted = fsm_compact(&fsm);
+    assert(compacted && "Buy more RAM lol");
+    (void)compacted;
+    result.compile_ns = bench_now() - start;
+    bench_table(&result, fsm);
+
+    snprintf(variant, sizeof(variant), "%s/compact", name);
+    BENCH_MEASURE(result, { fsm.state = 0; bench_sink = fsm_run_bytes(&fsm, input, size).state; });
+    bench_print(result);
+
+    // The same input as FSM_MULTI_LANES independent streams
+    const uint8_t *inputs[FSM_MULTI_LANES];
+    size_t lens[FSM_MULTI_LANES];
+    fsm_state_t states[FSM_MULTI_LANES];
+    for (size_t i = 0; i < FSM_MULTI_LANES; ++i) {
+      inputs[i] = input + i*(size/FSM_MULTI_LANES);
+      lens[i] = size/FSM_MULTI_LANES;
+    }
+    snprintf(variant, sizeof(variant), "%s/multi", name);
+    fsm.state = 0;
+    BENCH_MEASURE(result, { fsm_run_multi(fsm, inputs, lens, states, FSM_MULTI_LANES); bench_sink = states[0]; });
+    bench_print(result);
+
+    // Every chunk but the first is mapped from all start states, which only
+    // pays off for small tables
+    if (shape.states <= 256) {
+      snprintf(variant, sizeof(variant), "%s/parallel4", name);
+      BENCH_MEASURE(result, { bench_sink = fsm_run_parallel(fsm, input, size, 4).state; });
+      bench_print(result);
+    }
+
+    // Breadth-first renumbering from state 0, which stays 0
+    start = bench_now();
+    fsm.state = 0;
+    bool reordered = fsm_reorder(&fsm, NULL, NULL);
+    assert(reordered && "Buy more RAM lol");
+    (void)reordered;
+    result.compile_ns = bench_now() - start;
+    snprintf(variant, sizeof(variant), "%s/reordered", name);
+    BENCH_MEASURE(result, { fsm.state = 0; bench_sink = fsm_run_bytes(&fsm, input, size).state; });
+    bench_print(result);
+    fsm_free(fsm);
+  }
+  free(input);
+}
+
+// The self-test patterns of examples/regex.c, plus copies scaled up by
+// concatenating each one with itself. Anchored ones are not scaled:
+// (^ab$)(^ab$) can never match and collapses to a single state.
+const char *bench_patterns[] = {
+  "abc",
+  "abc?d",
+  "a*bc",
+  "a+bc",
+  "(ab)+c",
+  "(ab)*c",
+  "a.c",
+  "[a-z]+",
+  "[^0-9]*",
+  "a{2,3}",
+  "((a|b)c){2}d",
+  "^ab$",
+  "(?u)caf.",
+  "(?u)[\xd0\xb0-\xd1\x8f]+",
+};
+
+#define BENCH_SCALE 8
+
+char *bench_scale(const char *pattern, size_t times) {
+  const char *body = pattern;
+  bool utf8 = strncmp(pattern, "(?u)", 4) == 0;
+  if (utf8) body += 4;
+  size_t len = strlen(body);
+  char *scaled = malloc(4 + times*(len + 2) + 1), *it = scaled;
+  assert(scaled && "Buy more RAM lol");
+  if (utf8) it += sprintf(it, "(?u)");
+  for (size_t i = 0; i < times; ++i) it += sprintf(it, "(%s)", body);
+  return scaled;
+}
+
+// Whether `pattern` has ^ or $ outside a bracket expression
+bool bench_anchored(const char *pattern) {
+  bool in_class = false;
+  for (const char *c = pattern; *c; ++c) {
+    if (*c == '\\' && c[1]) {
+      ++c;
+    } else if (in_class) {
+      in_class = *c != ']';
+    } else if (*c == '[') {
+      // A ']' right after the opening bracket (or its '^') is a literal
+      if (c[1] == '^') ++c;
+      if (c[1] == ']') ++c;
+      in_class = true;
+    } else if (*c == '^' || *c == '$') {
+      return true;
+    }
+  }
+  return false;
+}
+
+size_t bench_find_all(regex_lazy_t *regex, const char *text, size_t len) {
+  size_t count = 0;
+  regex_span_t span;
+  for (size_t from = 0; from <= len && regex_find(regex, text, len, from, &span); ++count) {
+    from = span.end > span.start ? span.end : span.end + 1;
+  }
+  return count;
+}
+
+// Lazy tables are built while matching, so they are measured after. A
+// prefilter that never fires means they were not needed at all.
+void bench_lazy_tables(const regex_lazy_t *lazy, bench_result_t *result) {
+  regex_cache_t *caches[] = { lazy->cache, lazy->search, lazy->backward };
+  result->table_bytes = result->shuffle_bytes = result->states = 0;
+  for (size_t i = 0; i < sizeof(caches)/sizeof(caches[0]); ++i) {
+    if (!caches[i]) continue;
+    bench_result_t table;
+    bench_table(&table, caches[i]->fsm);
+    result->table_bytes += table.table_bytes;
+    result->shuffle_bytes += table.shuffle_bytes;
+    result->states += caches[i]->fsm.count;
+  }
+}
+
+// regex/match/* rows run the same job on both engines: every line matched
+// as a whole, "matches" counting the lines that do. regex/find/* searches
+// the whole corpus instead and counts non-overlapping occurrences, so its
+// numbers do not compare with the match rows. `lines` holds the corpus with
+// every '\n' turned into a '\0' so lines can be taken one at a time.
+void bench_regex(const char *pattern, const char *corpus, const char *lines, size_t size) {
+  char name[256];
+  bench_result_t result = { .bytes = size };
+
+  snprintf(name, sizeof(name), "regex/match/dfa/%s", pattern);
+  if (bench_enabled(name)) {
+    result.name = name;
+    regex_t regex = {0};
+    regex_init(&regex);
+    uint64_t start = bench_now();
+    bool compiled = regex_compile(&regex, pattern);
+    result.compile_ns = bench_now() - start;
+    if (compiled) {
+      bench_table(&result, regex.fsm);
+      result.states = regex.fsm.count;
+      BENCH_MEASURE(result, {
+        result.matches = 0;
+        for (const char *line = lines; line < lines + size; line += strlen(line) + 1) result.matches += regex_match(&regex, line);
+      });
+      bench_print(result);
+    }
+    regex_free(regex);
+  }
+
+  snprintf(name, sizeof(name), "regex/match/lazy/%s", pattern);
+  if (bench_enabled(name)) {
+    result.name = name;
+    regex_lazy_t lazy = {0};
+    uint64_t start = bench_now();
+    bool compiled = regex_lazy_compile(&lazy, pattern);
+    result.compile_ns = bench_now() - start;
+    assert(compiled);
+    (void)compiled;
+    BENCH_MEASURE(result, {
+      result.matches = 0;
+      for (const char *line = lines; line < lines + size; line += strlen(line) + 1) result.matches += regex_lazy_match(&lazy, line);
+    });
+    bench_lazy_tables(&lazy, &result);
+    bench_print(result);
+    regex_lazy_free(lazy);
+  }
+
+  snprintf(name, sizeof(name), "regex/find/lazy/%s", pattern);
+  if (bench_enabled(name)) {
+    result.name = name;
+    regex_lazy_t lazy = {0};
+    uint64_t start = bench_now();
+    bool compiled = regex_lazy_compile(&lazy, pattern);
+    result.compile_ns = bench_now() - start;
+    assert(compiled);
+    (void)compiled;
+    BENCH_MEASURE(result, { result.matches = bench_find_all(&lazy, corpus, size); });
+    bench_lazy_tables(&lazy, &result);
+    bench_print(result);
+    regex_lazy_free(lazy);
+  }
+}
+
+void bench_regex_set(const char *corpus, size_t size) {
+  size_t count = sizeof(bench_patterns)/sizeof(bench_patterns[0]);
+  bench_result_t result = { .bytes = size };
+  regex_set_t set = {0};
+  if (bench_enabled("regex/set") || bench_enabled("regex/stream")) {
+    uint64_t start = bench_now();
+    bool compiled = regex_set_compile(&set, bench_patterns, count, true);
+    result.compile_ns = bench_now() - start;
+    assert(compiled);
+    (void)compiled;
+    bench_table(&result, set.fsm);
+    result.states = set.fsm.count;
+  }
+
+  if (bench_enabled("regex/set")) {
+    result.name = "regex/set";
+    uint64_t *matched = malloc(sizeof(*matched) * set.words);
+    assert(matched && "Buy more RAM lol");
+    BENCH_MEASURE(result, { result.matches = regex_set_match(&set, corpus, size, matched); });
+    bench_print(result);
+    free(matched);
+  }
+
+  if (bench_enabled("regex/stream")) {
+    result.name = "regex/stream";
+    BENCH_MEASURE(result, {
+      regex_stream_t stream = regex_stream(&set);
+      result.matches = 0;
+      for (size_t at = 0; at < size; at += 4096) {
+        result.matches += regex_stream_feed(&stream, corpus + at, size - at < 4096 ? size - at : 4096, NULL, NULL);
+      }
+      result.matches += regex_stream_finish(&stream, NULL, NULL);
+    });
+    bench_print(result);
+  }
+  if (fsm_initialized(set.fsm)) regex_set_free(set);
+}
+
+// Lines of short words over a small alphabet, so the patterns above
+// actually find something, with every 16th word in Cyrillic
+char *bench_corpus(size_t size) {
+  static const char *cyrillic[] = { "\xd0\xbf\xd1\x80\xd0\xb8", "\xd0\xbc\xd0\xb8\xd1\x80", "\xd0\xb4\xd0\xb0" };
+  char *corpus = malloc(size + 1);
+  assert(corpus && "Buy more RAM lol");
+  uint64_t seed = 0x2545F4914F6CDD1DULL;
+  size_t i = 0, line = 0;
+  while (i < size) {
+    uint64_t r = bench_random(&seed);
+    if (r % 16 == 0) {
+      for (const char *it = cyrillic[r/16 % 3]; *it && i < size; ++it) corpus[i++] = *it;
+    } else {
+      size_t len = 1 + r/16 % 8;
+      for (size_t j = 0; j < len && i < size; ++j) corpus[i++] = "abcdeabcdz0123"[bench_random(&seed) % 14];
+    }
+    if (i < size) corpus[i++] = ++line % 12 == 0 ? '\n' : ' ';
+  }
+  corpus[size] = '\0';
+  return corpus;
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1) bench_filter = argv[1];
+  size_t megabytes = argc > 2 ? strtoul(argv[2], NULL, 10) : 16;
+  size_t size = megabytes << 20;
+
+  char *corpus = bench_corpus(size);
+  char *lines = malloc(size + 1);
+  assert(lines && "Buy more RAM lol");
+  for (size_t i = 0; i <= size; ++i) lines[i] = corpus[i] == '\n' ? '\0' : corpus[i];
+
+  bench_random_dfas(size);
+  for (size_t i = 0; i < sizeof(bench_patterns)/sizeof(bench_patterns[0]); ++i) {
+    bench_regex(bench_patterns[i], corpus, lines, size);
+    if (bench_anchored(bench_patterns[i])) continue;
+    char *scaled = bench_scale(bench_patterns[i], BENCH_SCALE);
+    bench_regex(scaled, corpus, lines, size);
+    free(scaled);
+  }
+  bench_regex_set(corpus, size);
+
+  free(lines);
+  free(corpus);
+  return 0;
+}
@@ -0,0 +1,509 @@
+#define FSM_IMPLEMENTATION
+#include "fsm.h"
+
+#define AC_NO_NODE UINT32_MAX
+#define AC_ROOT    0
+
+typedef enum {
+  AC_DENSE,        // Full transitions in a compacted fsm_t, one lookup per byte
+  AC_DOUBLE_ARRAY, // Trie only, in base/check arrays, failure links at match time
+} ac_layout_t;
+
+// Keyword trie. Edges live in an open addressing table keyed by
+// (parent << 8 | byte), children of a node are also chained through
+// `first_child`/`next_sibling` so they can be walked in order.
+typedef struct {
+  uint64_t *keys;
+  uint32_t *values;
+  size_t edge_capacity;
+  size_t edge_count;
+  uint32_t *first_child;
+  uint32_t *next_sibling;
+  uint8_t *label;
+  size_t count;
+  size_t capacity;
+} ac_trie_t;
+
+uint32_t ac__trie_child(const ac_trie_t *trie, uint32_t node, uint8_t byte) {
+  uint64_t key = (uint64_t)node << 8 | byte;
+  size_t mask = trie->edge_capacity - 1;
+  for (size_t slot = (key * 0x9E3779B97F4A7C15ULL) >> 20 & mask; trie->values[slot] != AC_NO_NODE; slot = (slot + 1) & mask) {
+    if (trie->keys[slot] == key) return trie->values[slot];
+  }
+  return AC_NO_NODE;
+}
+
+void ac__trie_link(ac_trie_t *trie, uint64_t key, uint32_t child) {
+  size_t mask = trie->edge_capacity - 1;
+  size_t slot = (key * 0x9E3779B97F4A7C15ULL) >> 20 & mask;
+  while (trie->values[slot] != AC_NO_NODE) slot = (slot + 1) & mask;
+  trie->keys[slot] = key;
+  trie->values[slot] = child;
+}
+
+uint32_t ac__trie_push(ac_trie_t *trie, uint32_t parent, uint8_t byte) {
+  if (trie->count >= trie->capacity) {
+    trie->capacity = trie->capacity == 0 ? 256 : trie->capacity*2;
+    trie->first_child = realloc(trie->first_child, sizeof(*trie->first_child) * trie->capacity);
+    trie->next_sibling = realloc(trie->next_sibling, sizeof(*trie->next_sibling) * trie->capacity);
+    trie->label = realloc(trie->label, sizeof(*trie->label) * trie->capacity);
+    assert(trie->first_child && trie->next_sibling && trie->label && "Buy more RAM lol");
+  }
+  if ((trie->edge_count + 1) * 2 > trie->edge_capacity) {
+    uint64_t *keys = trie->keys;
+    uint32_t *values = trie->values;
+    size_t capacity = trie->edge_capacity;
+    trie->edge_capacity = capacity == 0 ? 1024 : capacity*2;
+    trie->keys = malloc(sizeof(*trie->keys) * trie->edge_capacity);
+    trie->values = malloc(sizeof(*trie->values) * trie->edge_capacity);
+    assert(trie->keys && trie->values && "Buy more RAM lol");
+    for (size_t i = 0; i < trie->edge_capacity; ++i) trie->values[i] = AC_NO_NODE;
+    for (size_t i = 0; i < capacity; ++i) if (values[i] != AC_NO_NODE) ac__trie_link(trie, keys[i], values[i]);
+    free(keys);
+    free(values);
+  }
+
+  uint32_t node = (uint32_t)trie->count++;
+  trie->first_child[node] = AC_NO_NODE;
+  trie->label[node] = byte;
+  if (node != AC_ROOT) {
+    // Keep siblings sorted by byte, the double array places them in order
+    uint32_t *link = &trie->first_child[parent];
+    while (*link != AC_NO_NODE && trie->label[*link] < byte) link = &trie->next_sibling[*link];
+    trie->next_sibling[node] = *link;
+    *link = node;
+    ac__trie_link(trie, (uint64_t)parent << 8 | byte, node);
+    ++trie->edge_count;
+  }
+  return node;
+}
+
+void ac__trie_free(ac_trie_t trie) {
+  free(trie.keys);
+  free(trie.values);
+  free(trie.first_child);
+  free(trie.next_sibling);
+  free(trie.label);
+}
+
+// Every state has the keywords ending exactly there, outputs[output_offsets[s]
+// .. output_offsets[s+1]], and `output_link`, the closest state down its
+// failure chain that has any (AC_NO_NODE if none). Together they give all
+// keywords that end at the current position without storing them twice.
+typedef struct {
+  ac_layout_t layout;
+  size_t pattern_count;
+  size_t *lengths;
+  size_t *output_offsets;
+  uint32_t *outputs;
+  uint32_t *output_link;
+  size_t size; // States for AC_DENSE, cells for AC_DOUBLE_ARRAY
+  fsm_t fsm;
+  uint32_t *base, *check, *fail;
+} ac_t;
+
+typedef struct {
+  uint32_t pattern;
+  size_t start;
+  size_t end;
+} ac_match_t;
+
+typedef void (*ac_report_t)(void *user, ac_match_t match);
+
+// Carries the automaton state and the absolute offset between chunks
+typedef struct {
+  uint32_t state;
+  size_t offset;
+} ac_stream_t;
+
+// Double array placement: children of a node with labels c go to base + c + 1
+// and are claimed by writing the parent into check. Free cells are kept in
+// a doubly linked list so placement only visits cells that could work.
+typedef struct {
+  uint32_t *base, *check;
+  uint32_t *next_free, *prev_free;
+  size_t size;
+  uint32_t first_free;
+} ac__double_array_t;
+
+#define AC_FREE UINT32_MAX
+
+void ac__double_array_grow(ac__double_array_t *da, size_t size) {
+  if (size <= da->size) return;
+  size_t new_size = da->size == 0 ? 1024 : da->size;
+  while (new_size < size) new_size *= 2;
+  da->base = realloc(da->base, sizeof(*da->base) * new_size);
+  da->check = realloc(da->check, sizeof(*da->check) * new_size);
+  da->next_free = realloc(da->next_free, sizeof(*da->next_free) * new_size);
+  da->prev_free = realloc(da->prev_free, sizeof(*da->prev_free) * new_size);
+  assert(da->base && da->check && da->next_free && da->prev_free && "Buy more RAM lol");
+  uint32_t last = da->first_free == AC_FREE ? AC_FREE : da->prev_free[da->first_free];
+  for (size_t i = da->size; i < new_size; ++i) {
+    da->base[i] = 0;
+    da->check[i] = AC_FREE;
+    da->prev_free[i] = last;
+    if (last == AC_FREE) da->first_free = (uint32_t)i;
+    else da->next_free[last] = (uint32_t)i;
+    last = (uint32_t)i;
+  }
+  // Circular, so the tail is one hop away from the head
+  da->next_free[last] = da->first_free;
+  da->prev_free[da->first_free] = last;
+  da->size = new_size;
+}
+
+void ac__double_array_take(ac__double_array_t *da, uint32_t cell, uint32_t parent) {
+  assert(da->check[cell] == AC_FREE);
+  da->check[cell] = parent;
+  uint32_t next = da->next_free[cell], prev = da->prev_free[cell];
+  if (next == cell) da->first_free = AC_FREE;
+  else {
+    da->next_free[prev] = next;
+    da->prev_free[next] = prev;
+    if (da->first_free == cell) da->first_free = next;
+  }
+}
+
+uint32_t ac__double_array_place(ac__double_array_t *da, const uint8_t *labels, size_t n) {
+  for (;;) {
+    if (da->first_free == AC_FREE) ac__double_array_grow(da, da->size + 1);
+    uint32_t cell = da->first_free;
+    do {
+      if (cell > labels[0] + 1u) {
+        uint32_t base = cell - labels[0] - 1;
+        size_t last = base + labels[n-1] + 1u;
+        if (last >= da->size) ac__double_array_grow(da, last + 1);
+        bool fits = true;
+        for (size_t i = 1; fits && i < n; ++i) fits = da->check[base + labels[i] + 1] == AC_FREE;
+        if (fits) return base;
+      }
+      cell = da->next_free[cell];
+    } while (cell != da->first_free);
+    ac__double_array_grow(da, da->size * 2);
+  }
+}
+
+// Builds the automaton for `count` non-empty keywords
+bool ac_compile(ac_t *ac, const char *const *patterns, size_t count, ac_layout_t layout) {
+  ac_trie_t trie = {0};
+  uint32_t *ends = malloc(sizeof(*ends) * (count + 1));
+  ac->lengths = malloc(sizeof(*ac->lengths) * (count + 1));
+  assert(ends && ac->lengths && "Buy more RAM lol");
+  ac__trie_push(&trie, AC_ROOT, 0);
+  for (size_t i = 0; i < count; ++i) {
+    size_t len = strlen(patterns[i]);
+    if (len == 0) {
+      ac__trie_free(trie);
+      free(ends);
+      free(ac->lengths);
+      return false;
+    }
+    uint32_t node = AC_ROOT;
+    for (size_t j = 0; j < len; ++j) {
+      uint8_t byte = (uint8_t)patterns[i][j];
+      uint32_t child = ac__trie_child(&trie, node, byte);
+      node = child != AC_NO_NODE ? child : ac__trie_push(&trie, node, byte);
+    }
+    ends[i] = node;
+    ac->lengths[i] = len;
+  }
+  size_t n = trie.count;
+
+  // Keywords grouped by the node they end at
+  size_t *offsets = calloc(n + 1, sizeof(*offsets));
+  uint32_t *outputs = malloc(sizeof(*outputs) * (count + 1));
+  assert(offsets && outputs && "Buy more RAM lol");
+  for (size_t i = 0; i < count; ++i) ++offsets[ends[i] + 1];
+  for (size_t i = 0; i < n; ++i) offsets[i+1] += offsets[i];
+  for (size_t i = 0; i < count; ++i) outputs[offsets[ends[i]]++] = (uint32_t)i;
+  for (size_t i = n; i > 0; --i) offsets[i] = offsets[i-1];
+  offsets[0] = 0;
+  free(ends);
+
+  // Failure and output links, breadth first so a node's failure target is
+  // always done before the node itself
+  uint32_t *order = malloc(sizeof(*order) * n);
+  uint32_t *fail = malloc(sizeof(*fail) * n);
+  uint32_t *link = malloc(sizeof(*link) * n);
+  assert(order && fail && link && "Buy more RAM lol");
+  size_t head = 0, tail = 0;
+  order[tail++] = AC_ROOT;
+  fail[AC_ROOT] = AC_ROOT;
+  link[AC_ROOT] = AC_NO_NODE;
+  while (head < tail) {
+    uint32_t node = order[head++];
+    for (uint32_t child = trie.first_child[node]; child != AC_NO_NODE; child = trie.next_sibling[child]) {
+      uint32_t f = AC_ROOT;
+      if (node != AC_ROOT) {
+        f = fail[node];
+        uint32_t next;
+        while ((next = ac__trie_child(&trie, f, trie.label[child])) == AC_NO_NODE && f != AC_ROOT) f = fail[f];
+        if (next != AC_NO_NODE) f = next;
+      }
+      fail[child] = f;
+      link[child] = offsets[f+1] > offsets[f] ? f : link[f];
+      order[tail++] = child;
+    }
+  }
+
+  ac->layout = layout;
+  ac->pattern_count = count;
+  ac->outputs = outputs;
+  bool ok = true;
+  if (layout == AC_DENSE) {
+    fsm_init(&ac->fsm, 256);
+    ok = fsm_reserve(&ac->fsm, n);
+    for (size_t i = 0; ok && i < n; ++i) (void)fsm_push_empty(&ac->fsm);
+    for (size_t i = 0; ok && i < n; ++i) {
+      uint32_t node = order[i];
+      if (node != AC_ROOT) {
+        for (size_t b = 0; b < 256; ++b) fsm_set(&ac->fsm, node, b, fsm_get(ac->fsm, fail[node], b));
+      }
+      for (uint32_t child = trie.first_child[node]; child != AC_NO_NODE; child = trie.next_sibling[child]) {
+        fsm_set(&ac->fsm, node, trie.label[child], child);
+      }
+      fsm_set_accepting(&ac->fsm, node, offsets[node+1] > offsets[node] || link[node] != AC_NO_NODE);
+    }
+    if (ok) {
+      (void)fsm_compress_events(&ac->fsm);
+      ok = fsm_compact(&ac->fsm);
+    }
+    ac->size = n;
+    ac->output_offsets = offsets;
+    ac->output_link = link;
+    free(fail);
+  } else {
+    ac__double_array_t da = { .first_free = AC_FREE };
+    ac__double_array_grow(&da, n + 257);
+    uint32_t *cell = malloc(sizeof(*cell) * n);
+    uint8_t *labels = malloc(256);
+    assert(cell && labels && "Buy more RAM lol");
+    cell[AC_ROOT] = 0;
+    ac__double_array_take(&da, 0, AC_ROOT);
+    for (size_t i = 0; i < n; ++i) {
+      uint32_t node = order[i];
+      size_t k = 0;
+      for (uint32_t child = trie.first_child[node]; child != AC_NO_NODE; child = trie.next_sibling[child]) labels[k++] = trie.label[child];
+      if (k == 0) continue;
+      uint32_t base = ac__double_array_place(&da, labels, k);
+      da.base[cell[node]] = base;
+      for (uint32_t child = trie.first_child[node]; child != AC_NO_NODE; child = trie.next_sibling[child]) {
+        cell[child] = base + trie.label[child] + 1;
+        ac__double_array_take(&da, cell[child], cell[node]);
+      }
+    }
+    free(labels);
+
+    // Move the per node tables over to cells
+    ac->size = da.size;
+    ac->fail = malloc(sizeof(*ac->fail) * da.size);
+    ac->output_link = malloc(sizeof(*ac->output_link) * da.size);
+    ac->output_offsets = malloc(sizeof(*ac->output_offsets) * (da.size + 1));
+    uint32_t *node_at = malloc(sizeof(*node_at) * da.size);
+    assert(ac->fail && ac->output_link && ac->output_offsets && node_at && "Buy more RAM lol");
+    for (size_t c = 0; c < da.size; ++c) node_at[c] = AC_NO_NODE;
+    for (size_t node = 0; node < n; ++node) node_at[cell[node]] = (uint32_t)node;
+    uint32_t *moved = malloc(sizeof(*moved) * (count + 1));
+    assert(moved && "Buy more RAM lol");
+    size_t out = 0;
+    for (size_t c = 0; c < da.size; ++c) {
+      uint32_t node = node_at[c];
+      ac->output_offsets[c] = out;
+      if (node == AC_NO_NODE) continue;
+      ac->fail[c] = cell[fail[node]];
+      ac->output_link[c] = link[node] == AC_NO_NODE ? AC_NO_NODE : cell[link[node]];
+      for (size_t i = offsets[node]; i < offsets[node+1]; ++i) moved[out++] = outputs[i];
+    }
+    ac->output_offsets[da.size] = out;
+    ac->outputs = moved;
+    free(outputs);
+    free(node_at);
+    free(cell);
+    free(da.next_free);
+    free(da.prev_free);
+    free(offsets);
+    free(fail);
+    free(link);
+    ac->base = da.base;
+    ac->check = da.check;
+  }
+  free(order);
+  ac__trie_free(trie);
+  return ok;
+}
+
+size_t ac__report(const ac_t *ac, uint32_t state, size_t end, ac_report_t report, void *user) {
+  size_t found = 0;
+  for (; state != AC_NO_NODE; state = ac->output_link[state]) {
+    for (size_t i = ac->output_offsets[state]; i < ac->output_offsets[state+1]; ++i) {
+      uint32_t pattern = ac->outputs[i];
+      if (report) report(user, (ac_match_t){ .pattern = pattern, .start = end - ac->lengths[pattern], .end = end });
+      ++found;
+    }
+  }
+  return found;
+}
+
+ac_stream_t ac_stream(void) {
+  return (ac_stream_t){ .state = AC_ROOT, .offset = 0 };
+}
+
+// Feeds the next `n` bytes of a stream and reports every keyword occurrence
+// that ends in them, overlapping ones included. Returns how many there were.
+size_t ac_scan(ac_t *ac, ac_stream_t *stream, const uint8_t *bytes, size_t n, ac_report_t report, void *user) {
+  size_t found = 0;
+  uint32_t state = stream->state;
+  if (ac->layout == AC_DENSE) {
+    // The batch runner stops on every state where some keyword ends, so
+    // this loop only goes around once per match
+    ac->fsm.state = state;
+    for (size_t i = 0; i < n;) {
+      fsm_run_t run = fsm_scan_bytes(&ac->fsm, bytes + i, n - i);
+      i += run.consumed;
+      // Still on a state that has been reported, by now or by the last chunk
+      if (run.consumed == 0) fsm_fire_event(&ac->fsm, bytes[i++]);
+      if (fsm_is_accepting(ac->fsm, ac->fsm.state)) found += ac__report(ac, ac->fsm.state, stream->offset + i, report, user);
+    }
+    state = ac->fsm.state;
+  } else {
+    for (size_t i = 0; i < n; ++i) {
+      uint32_t code = bytes[i] + 1u;
+      uint32_t next;
+      for (;;) {
+        next = ac->base[state] + code;
+        if (next < ac->size && ac->check[next] == state && next != AC_ROOT) break;
+        if (state == AC_ROOT) {
+          next = AC_ROOT;
+          break;
+        }
+        state = ac->fail[state];
+      }
+      state = next;
+      if (ac->output_offsets[state+1] > ac->output_offsets[state] || ac->output_link[state] != AC_NO_NODE) {
+        found += ac__report(ac, state, stream->offset + i + 1, report, user);
+      }
+    }
+  }
+  stream->state = state;
+  stream->offset += n;
+  return found;
+}
+
+void ac_free(ac_t ac) {
+  free(ac.lengths);
+  free(ac.output_offsets);
+  free(ac.outputs);
+  free(ac.output_link);
+  if (fsm_initialized(ac.fsm)) fsm_free(ac.fsm);
+  free(ac.base);
+  free(ac.check);
+  free(ac.fail);
+}
+
+typedef struct {
+  char items[1024];
+  size_t count;
+} ac_log_t;
+
+void ac_log_match(void *user, ac_match_t match) {
+  ac_log_t *log = user;
+  log->count += snprintf(log->items + log->count, sizeof(log->items) - log->count, "%u@%zu ", match.pattern, match.start);
+}
+
+void ac_print_match(void *user, ac_match_t match) {
+  const char *const *patterns = user;
+  printf("%zu..%zu: %s\n", match.start, match.end, patterns[match.pattern]);
+}
+
+int main(int argc, char **argv) {
+  if (argc >= 2) {
+    // aho_corasick <keyword>... < input
+    const char *const *patterns = (const char *const *)argv + 1;
+    ac_t ac = {0};
+    if (!ac_compile(&ac, patterns, argc - 1, AC_DENSE)) {
+      fprintf(stderr, "Failed to build automaton!\n");
+      return 1;
+    }
+    ac_stream_t stream = ac_stream();
+    uint8_t buffer[64*1024];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), stdin)) > 0) ac_scan(&ac, &stream, buffer, n, ac_print_match, (void*)patterns);
+    ac_free(ac);
+    return 0;
+  }
+
+  typedef struct {
+    const char *patterns[8];
+    const char *text;
+    const char *expected; // pattern@start in the order they are reported
+  } test_t;
+  test_t tests[] = {
+    (test_t){
+      .patterns = { "he", "she", "his", "hers" },
+      .text = "ushers",
+      .expected = "1@1 0@2 3@2 "
+    },
+    (test_t){
+      .patterns = { "a", "aa", "aaa" },
+      .text = "aaaa",
+      .expected = "0@0 1@0 0@1 2@0 1@1 0@2 2@1 1@2 0@3 "
+    },
+    (test_t){
+      .patterns = { "abc", "bcd", "cde" },
+      .text = "xxabcdexx",
+      .expected = "0@2 1@3 2@4 "
+    },
+    (test_t){
+      .patterns = { "ERROR", "WARN", "error" },
+      .text = "no problems here",
+      .expected = ""
+    },
+    (test_t){
+      .patterns = { "ab", "ab", "b" },
+      .text = "abab",
+      .expected = "0@0 1@0 2@1 0@2 1@2 2@3 "
+    },
+    (test_t){
+      .patterns = { "\xff\xfe", "\x01" },
+      .text = "\x01\xff\xfe\xff",
+      .expected = "1@0 0@1 "
+    },
+  };
+  size_t test_count = sizeof(tests)/sizeof(tests[0]);
+
+  for (size_t i = 0; i < test_count; ++i) {
+    test_t test = tests[i];
+    size_t pattern_count = 0;
+    while (pattern_count < 8 && test.patterns[pattern_count]) ++pattern_count;
+
+    printf("(%zu/%zu): ", i+1, test_count);
+    for (ac_layout_t layout = AC_DENSE; layout <= AC_DOUBLE_ARRAY; ++layout) {
+      ac_t ac = {0};
+      if (!ac_compile(&ac, test.patterns, pattern_count, layout)) {
+        printf("Failed!\nCould not build automaton\n");
+        return 1;
+      }
+
+      // Feed it a byte at a time as well, matches must not depend on chunking
+      size_t len = strlen(test.text);
+      for (size_t chunk = len > 0 ? len : 1; chunk >= 1; chunk = chunk == 1 ? 0 : 1) {
+        ac_log_t log = {0};
+        ac_stream_t stream = ac_stream();
+        for (size_t at = 0; at < len; at += chunk) {
+          size_t n = len - at < chunk ? len - at : chunk;
+          ac_scan(&ac, &stream, (const uint8_t*)test.text + at, n, ac_log_match, &log);
+        }
+        if (strcmp(log.items, test.expected) != 0) {
+          printf("Failed!\n");
+          printf("Expected \"%s\" but got \"%s\" (%s, %zu byte chunks)\n", test.expected, log.items,
+                 layout == AC_DENSE ? "dense" : "double array", chunk);
+          return 1;
+        }
+      }
+      ac_free(ac);
+    }
+    printf("Success!\n");
+  }
+
+  return 0;
+}
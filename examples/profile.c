@@ -0,0 +1,85 @@
+// Self-test for FSM_PROFILE. Built on its own so that tables.c checks the
+// runners the way everyone else compiles them, without the profiling hooks.
+#define FSM_PROFILE
+#define TABLES_NO_MAIN
+#include "tables.c"
+
+// Counts the steps fsm_run_bytes takes from `start` by hand
+void profile_walk(fsm_t fsm, fsm_state_t start, const uint8_t *input, size_t n, uint64_t *visits, uint64_t *transitions) {
+  fsm_state_t state = start;
+  for (size_t i = 0; i < n && state < fsm.count && state != fsm.dead; ++i) {
+    ++visits[state];
+    ++transitions[(size_t)state*fsm.class_count + fsm__class(fsm, input[i])];
+    state = fsm_get(fsm, state, input[i]);
+  }
+}
+
+// Every runner bumps the attached profile once per step it takes, and only
+// for the table the profile was made for
+bool profile_counts(void) {
+  uint64_t seed = 14;
+  bool ok = true;
+  static uint8_t input[4*FSM_PARALLEL_MIN_CHUNK];
+  for (size_t t = 0; ok && t < TABLES_COUNT; ++t) {
+    fsm_t fsm, reference;
+    tables_pair(t, &fsm, &reference);
+    fsm_profile_t profile;
+    size_t cells = fsm.count * fsm.class_count;
+    uint64_t *visits = calloc(fsm.count, sizeof(*visits));
+    uint64_t *transitions = calloc(cells, sizeof(*transitions));
+    assert(visits && transitions && "Buy more RAM lol");
+    ok = fsm_profile_init(&profile, fsm);
+    fsm_profile_t *previous = fsm_profile_attach(&profile);
+
+    fsm.state = (fsm_state_t)(tables_random(&seed) % fsm.count);
+    for (size_t i = 0; ok && i < 100 && fsm.state < fsm.count; ++i) {
+      fsm_event_t event = (fsm_event_t)(tables_random(&seed) % fsm.event_count);
+      ++visits[fsm.state];
+      ++transitions[(size_t)fsm.state*fsm.class_count + fsm__class(fsm, event)];
+      fsm_fire_event(&fsm, event);
+    }
+
+    size_t n = tables_random(&seed) % sizeof(input);
+    tables_input(input, n, fsm.event_count, &seed);
+    fsm_state_t start = (fsm_state_t)(tables_random(&seed) % fsm.count);
+    profile_walk(fsm, start, input, n, visits, transitions);
+    fsm.state = start;
+    ok = ok && fsm_run_bytes(&fsm, input, n).state == tables_reference(reference, start, input, n).state;
+
+    const uint8_t *inputs[3] = { input, input + n/3, input + n/2 };
+    size_t lens[3] = { n/3, n - n/2, n/4 };
+    fsm_state_t states[3];
+    fsm.state = (fsm_state_t)(tables_random(&seed) % fsm.count);
+    for (size_t i = 0; i < 3; ++i) profile_walk(fsm, fsm.state, inputs[i], lens[i], visits, transitions);
+    fsm_run_multi(fsm, inputs, lens, states, 3);
+
+    // Runs sequentially while profiling, so the counts stay exact
+    fsm.state = (fsm_state_t)(tables_random(&seed) % fsm.count);
+    profile_walk(fsm, fsm.state, input, n, visits, transitions);
+    ok = ok && fsm_run_parallel(fsm, input, n, 4).state == tables_reference(reference, fsm.state, input, n).state;
+
+    // A different table is not counted
+    reference.state = 0;
+    fsm_run_bytes(&reference, input, n);
+
+    ok = ok && fsm_profile_attach(previous) == &profile;
+    for (size_t s = 0; ok && s < fsm.count; ++s) ok = profile.visits[s] == visits[s];
+    for (size_t c = 0; ok && c < cells; ++c) ok = profile.transitions[c] == transitions[c];
+    fsm_profile_free(profile);
+    free(visits);
+    free(transitions);
+    fsm_free(fsm);
+    fsm_free(reference);
+  }
+  return ok;
+}
+
+int main(void) {
+  printf("(1/1) fsm_profile: ");
+  if (!profile_counts()) {
+    printf("Failed!\n");
+    return 1;
+  }
+  printf("Success!\n");
+  return 0;
+}
@@ -1,146 +1,1404 @@
 #define FSM_IMPLEMENTATION
 #include "fsm.h"
 
-#define REGEX_SPECIAL_ALLOWED_BIT 0x01
-#define REGEX_PASSTHROUGH_BIT     0x02
-#define REGEX_QMARK_BIT           0x04
-#define REGEX_ANY_BIT             0x08
-#define REGEX_BRACKET_BIT         0x10
+#ifndef REGEX_MAX_LITERAL
+#define REGEX_MAX_LITERAL  32
+#endif
+#define REGEX_MAX_LITERALS 8
 
-#define GET_BIT(n, b) (n&b)
-#define SET_BIT(n, b) n |= b
-#define CLEAR_BIT(n, b) n &= ~(b)
+typedef struct {
+  uint8_t bytes[REGEX_MAX_LITERAL];
+  size_t len;
+} regex_literal_t;
 
+// Literals every match has to contain: it starts with `prefix`, ends with
+// `suffix` and contains one of `any`. `exact` means the pattern matches
+// nothing but `prefix`.
 typedef struct {
-  fsm_t fsm;
-  uint8_t flags;
-  fsm_state_t prev_state;
-} regex_t;
+  regex_literal_t prefix;
+  regex_literal_t suffix;
+  regex_literal_t any[REGEX_MAX_LITERALS];
+  size_t any_count;
+  bool exact;
+} regex_prefilter_t;
 
-void regex_init(regex_t *regex) {
-  fsm_init(&regex->fsm, 127);
-  fsm_push_empty(&regex->fsm);
+// Syntax tree shared by all engines. Everything is built out of byte
+// ranges, concatenation, alternation, counted repetition and the ^ and $
+// assertions, which hold at the start and the end of the text.
+typedef enum {
+  REGEX_NODE_EMPTY,
+  REGEX_NODE_RANGE,
+  REGEX_NODE_CONCAT,
+  REGEX_NODE_ALTERNATE,
+  REGEX_NODE_REPEAT,
+  REGEX_NODE_BEGIN,
+  REGEX_NODE_END,
+} regex_node_kind_t;
+
+#define REGEX_UNBOUNDED UINT32_MAX
+#define REGEX_MAX_DEPTH 256
+// Every copy of a repeated body becomes NFA states of its own, so nested
+// counts multiply. Patterns are also rejected as a whole once their NFA
+// would outgrow REGEX_MAX_NFA_STATES.
+#define REGEX_MAX_REPEAT 1000
+#ifndef REGEX_MAX_NFA_STATES
+#define REGEX_MAX_NFA_STATES (1 << 18)
+#endif
+
+typedef struct {
+  regex_node_kind_t kind;
+  uint8_t lo, hi;
+  uint32_t lhs, rhs; // REPEAT only uses lhs
+  uint32_t min, max;
+} regex_node_t;
+
+typedef struct {
+  regex_node_t *items;
+  size_t count;
+  size_t capacity;
+  uint32_t root;
+  bool utf8; // Set by a leading (?u): `.` and literals stand for whole code points
+} regex_ast_t;
+
+uint32_t regex__node(regex_ast_t *ast, regex_node_t node) {
+  if (ast->count >= ast->capacity) {
+    ast->capacity = ast->capacity == 0 ? 16 : ast->capacity*2;
+    ast->items = realloc(ast->items, sizeof(*ast->items) * ast->capacity);
+    assert(ast->items && "Buy more RAM lol");
+  }
+  ast->items[ast->count] = node;
+  return (uint32_t)ast->count++;
 }
 
-void regex_free(regex_t regex) {
-  if (fsm_initialized(regex.fsm)) fsm_free(regex.fsm);
+uint32_t regex__range(regex_ast_t *ast, uint8_t lo, uint8_t hi) {
+  return regex__node(ast, (regex_node_t){ .kind = REGEX_NODE_RANGE, .lo = lo, .hi = hi });
 }
 
-bool regex_compile_bracket(regex_t *regex, const char *pattern, const char **end);
-bool regex_compile_expr(regex_t *regex, const char *pattern, const char **end) {
-  if (*pattern == '\\') {
-    ++pattern;
-    fsm_state_t state = regex->prev_state;
-    if (GET_BIT(regex->flags, REGEX_QMARK_BIT)) {
-      fsm_set(&regex->fsm, state, *pattern, regex->fsm.count+1);
-      state = fsm_push_empty(&regex->fsm);
-    } else if (!GET_BIT(regex->flags, REGEX_PASSTHROUGH_BIT)) state = fsm_push_empty(&regex->fsm);
-    fsm_set(&regex->fsm, state, *pattern, regex->fsm.count);
-    regex->flags = 0;
-    SET_BIT(regex->flags, REGEX_SPECIAL_ALLOWED_BIT);
-    regex->prev_state = state;
-    *end = ++pattern;
+uint32_t regex__pair(regex_ast_t *ast, regex_node_kind_t kind, uint32_t lhs, uint32_t rhs) {
+  return regex__node(ast, (regex_node_t){ .kind = kind, .lhs = lhs, .rhs = rhs });
+}
+
+#define REGEX_MAX_CODEPOINT 0x10FFFF
+
+size_t regex__utf8_encode(uint32_t cp, uint8_t *bytes) {
+  if (cp < 0x80) {
+    bytes[0] = (uint8_t)cp;
+    return 1;
+  }
+  size_t n = cp < 0x800 ? 2 : cp < 0x10000 ? 3 : 4;
+  for (size_t i = n-1; i > 0; --i, cp >>= 6) bytes[i] = 0x80 | (cp & 0x3F);
+  bytes[0] = (uint8_t)((0xF00 >> n) | cp);
+  return n;
+}
+
+// Rejects truncated sequences, overlong forms, surrogates and anything
+// past U+10FFFF
+bool regex__utf8_decode(const char *text, const char **end, uint32_t *cp) {
+  const uint8_t *bytes = (const uint8_t*)text;
+  size_t n = bytes[0] < 0x80 ? 1 : bytes[0] < 0xC0 ? 0 : bytes[0] < 0xE0 ? 2 : bytes[0] < 0xF0 ? 3 : bytes[0] < 0xF8 ? 4 : 0;
+  if (n == 0) return false;
+  *cp = n == 1 ? bytes[0] : bytes[0] & (0x7F >> n);
+  for (size_t i = 1; i < n; ++i) {
+    if ((bytes[i] & 0xC0) != 0x80) return false;
+    *cp = *cp << 6 | (bytes[i] & 0x3F);
+  }
+  static const uint32_t least[] = { 0, 0, 0x80, 0x800, 0x10000 };
+  if (*cp < least[n] || *cp > REGEX_MAX_CODEPOINT || (*cp >= 0xD800 && *cp <= 0xDFFF)) return false;
+  *end = text + n;
+  return true;
+}
+
+// Adds the code points lo..hi to the alternation in `node` as sequences of
+// byte ranges, the same way a DFA over UTF-8 would have to take them apart.
+// Every sequence has one encoded length and each of its bytes may vary over
+// a single range independently of the others, so no 256-wide tables are
+// needed anywhere.
+void regex__utf8_ranges(regex_ast_t *ast, uint32_t lo, uint32_t hi, uint32_t *node, bool *empty) {
+  if (lo > hi) return;
+  if (lo <= 0xDFFF && hi >= 0xD800) {
+    regex__utf8_ranges(ast, lo, 0xD7FF < hi ? 0xD7FF : hi, node, empty);
+    regex__utf8_ranges(ast, 0xE000 > lo ? 0xE000 : lo, hi, node, empty);
+    return;
+  }
+  static const uint32_t longest[] = { 0x7F, 0x7FF, 0xFFFF };
+  for (size_t i = 0; i < sizeof(longest)/sizeof(longest[0]); ++i) {
+    if (lo <= longest[i] && longest[i] < hi) {
+      regex__utf8_ranges(ast, lo, longest[i], node, empty);
+      regex__utf8_ranges(ast, longest[i]+1, hi, node, empty);
+      return;
+    }
+  }
+  for (uint32_t i = 1; hi > 0x7F && i < 4; ++i) {
+    uint32_t mask = (1u << 6*i) - 1;
+    if ((lo & ~mask) == (hi & ~mask)) continue;
+    if ((lo & mask) != 0) {
+      regex__utf8_ranges(ast, lo, lo | mask, node, empty);
+      regex__utf8_ranges(ast, (lo | mask) + 1, hi, node, empty);
+      return;
+    }
+    if ((hi & mask) != mask) {
+      regex__utf8_ranges(ast, lo, (hi & ~mask) - 1, node, empty);
+      regex__utf8_ranges(ast, hi & ~mask, hi, node, empty);
+      return;
+    }
+  }
+  uint8_t from[4], to[4];
+  size_t n = regex__utf8_encode(lo, from);
+  (void)regex__utf8_encode(hi, to);
+  uint32_t seq = regex__range(ast, from[0], to[0]);
+  for (size_t i = 1; i < n; ++i) seq = regex__pair(ast, REGEX_NODE_CONCAT, seq, regex__range(ast, from[i], to[i]));
+  *node = *empty ? seq : regex__pair(ast, REGEX_NODE_ALTERNATE, *node, seq);
+  *empty = false;
+}
+
+// A single byte, or a whole code point in UTF-8 mode
+bool regex__parse_literal(regex_ast_t *ast, const char *pattern, const char **end, uint32_t *node) {
+  if (!ast->utf8) {
+    *node = regex__range(ast, (uint8_t)*pattern, (uint8_t)*pattern);
+    *end = pattern+1;
     return true;
   }
-  switch(*pattern) {
-  case '?': {
-    if (!GET_BIT(regex->flags, REGEX_SPECIAL_ALLOWED_BIT)) return false;
-    regex->flags = 0;
-    SET_BIT(regex->flags, REGEX_PASSTHROUGH_BIT);
-    SET_BIT(regex->flags, REGEX_QMARK_BIT);
-  } break;
-  case '*': {
-    if (!GET_BIT(regex->flags, REGEX_SPECIAL_ALLOWED_BIT)) return false;
-    fsm_state_t state = regex->fsm.count-1;
-    for (fsm_event_t i = 32; i < 127; ++i) {
-      if (fsm_get(regex->fsm, state, i) != 0) fsm_set(&regex->fsm, state, i, regex->prev_state);
-    }
-    regex->flags = 0;
-    SET_BIT(regex->flags, REGEX_PASSTHROUGH_BIT);
-  } break;
-  case '+': {
-    if (!GET_BIT(regex->flags, REGEX_SPECIAL_ALLOWED_BIT)) return false;
-    fsm_state_t new_start = regex->fsm.count;
-    for (fsm_state_t it = regex->prev_state; it < new_start; ++it) fsm_duplicate(&regex->fsm, it);
-    fsm_state_t end_state = regex->fsm.count-1;
-    for (fsm_event_t i = 32; i < 127; ++i) {
-      for (fsm_state_t j = new_start; j < end_state; ++j) {
-        fsm_state_t val = fsm_get(regex->fsm, j, i);
-        if (val > 0) fsm_set(&regex->fsm, j, i, new_start+val-regex->prev_state);
-      }
+  uint32_t cp;
+  if (!regex__utf8_decode(pattern, end, &cp)) return false;
+  bool empty = true;
+  regex__utf8_ranges(ast, cp, cp, node, &empty);
+  return true;
+}
+
+typedef struct {
+  uint32_t lo, hi;
+} regex_class_range_t;
+
+int regex__compare_class_ranges(const void *a, const void *b) {
+  uint32_t x = ((const regex_class_range_t*)a)->lo, y = ((const regex_class_range_t*)b)->lo;
+  return (x > y) - (x < y);
+}
+
+// One member of a bracket class: a byte, or a code point in UTF-8 mode
+bool regex__parse_class_char(regex_ast_t *ast, const char *pattern, const char **end, uint32_t *c) {
+  if (*pattern == '\\') ++pattern;
+  if (*pattern == '\0') return false;
+  if (ast->utf8) return regex__utf8_decode(pattern, end, c);
+  *c = (uint8_t)*pattern;
+  *end = pattern+1;
+  return true;
+}
+
+void regex__class_add(regex_ast_t *ast, uint32_t lo, uint32_t hi, uint32_t *node, bool *empty) {
+  if (lo > hi) return;
+  if (ast->utf8) {
+    regex__utf8_ranges(ast, lo, hi, node, empty);
+    return;
+  }
+  uint32_t range = regex__range(ast, (uint8_t)lo, (uint8_t)hi);
+  *node = *empty ? range : regex__pair(ast, REGEX_NODE_ALTERNATE, *node, range);
+  *empty = false;
+}
+
+// [abc], [a-z], [^...]. A ']' right after the opening bracket and a '-' at
+// either end are taken literally. The ranges are sorted, merged and, for
+// negated classes, complemented before they turn into an alternation of
+// byte ranges (or UTF-8 sequences), so overlapping members cost nothing.
+bool regex__parse_class(regex_ast_t *ast, const char *pattern, const char **end, uint32_t *node) {
+  bool negated = *pattern == '^';
+  if (negated) ++pattern;
+  regex_class_range_t *ranges = NULL;
+  size_t count = 0, capacity = 0;
+  bool ok = true;
+  for (bool first = true; ok && (first || *pattern != ']'); first = false) {
+    regex_class_range_t range;
+    ok = regex__parse_class_char(ast, pattern, &pattern, &range.lo);
+    range.hi = range.lo;
+    if (ok && pattern[0] == '-' && pattern[1] != ']' && pattern[1] != '\0') {
+      ok = regex__parse_class_char(ast, pattern+1, &pattern, &range.hi) && range.lo <= range.hi;
+    }
+    if (!ok) break;
+    if (count >= capacity) {
+      capacity = capacity == 0 ? 8 : capacity*2;
+      ranges = realloc(ranges, sizeof(*ranges) * capacity);
+      assert(ranges && "Buy more RAM lol");
+    }
+    ranges[count++] = range;
+  }
+
+  if (ok) {
+    qsort(ranges, count, sizeof(*ranges), regex__compare_class_ranges);
+    size_t merged = 0;
+    for (size_t i = 0; i < count; ++i) {
+      if (merged > 0 && ranges[i].lo <= ranges[merged-1].hi + 1) {
+        if (ranges[i].hi > ranges[merged-1].hi) ranges[merged-1].hi = ranges[i].hi;
+      } else ranges[merged++] = ranges[i];
     }
 
-    regex->flags = 0;
-    regex->prev_state = new_start;
-    SET_BIT(regex->flags, REGEX_PASSTHROUGH_BIT);
+    bool empty = true;
+    if (negated) {
+      uint32_t next = 0;
+      for (size_t i = 0; i < merged; ++i) {
+        if (ranges[i].lo > next) regex__class_add(ast, next, ranges[i].lo - 1, node, &empty);
+        next = ranges[i].hi + 1;
+      }
+      regex__class_add(ast, next, ast->utf8 ? REGEX_MAX_CODEPOINT : 255, node, &empty);
+    } else for (size_t i = 0; i < merged; ++i) regex__class_add(ast, ranges[i].lo, ranges[i].hi, node, &empty);
+    // C strings cannot spell out every byte, so a class is never empty
+    assert(!empty);
+    *end = pattern+1;
+  }
+  free(ranges);
+  return ok;
+}
+
+bool regex__parse_alternate(regex_ast_t *ast, const char *pattern, const char **end, uint32_t *node, size_t depth);
+bool regex__parse_atom(regex_ast_t *ast, const char *pattern, const char **end, uint32_t *node, size_t depth) {
+  switch (*pattern) {
+  case '(': {
+    if (depth >= REGEX_MAX_DEPTH) return false;
+    if (!regex__parse_alternate(ast, pattern+1, &pattern, node, depth+1)) return false;
+    if (*pattern != ')') return false;
   } break;
   case '.': {
-    if (GET_BIT(regex->flags, REGEX_QMARK_BIT)) return false;
-    fsm_state_t state = regex->prev_state;
-    if (!GET_BIT(regex->flags, REGEX_PASSTHROUGH_BIT)) state = fsm_push_empty(&regex->fsm);
-    for (fsm_event_t i = 32; i < 127; ++i) fsm_set(&regex->fsm, state, i, regex->fsm.count);
-    regex->flags = 0;
-    regex->prev_state = state;
-    SET_BIT(regex->flags, REGEX_ANY_BIT);
-    SET_BIT(regex->flags, REGEX_SPECIAL_ALLOWED_BIT);
+    if (ast->utf8) {
+      bool empty = true;
+      regex__utf8_ranges(ast, 0, '\n'-1, node, &empty);
+      regex__utf8_ranges(ast, '\n'+1, REGEX_MAX_CODEPOINT, node, &empty);
+    } else *node = regex__pair(ast, REGEX_NODE_ALTERNATE, regex__range(ast, 0, '\n'-1), regex__range(ast, '\n'+1, 255));
   } break;
-  case '(': {
-    if (GET_BIT(regex->flags, REGEX_BRACKET_BIT)) return false;
-    if (!regex_compile_bracket(regex, ++pattern, &pattern)) return false;
-    --pattern;
-  } break;
-  default: {
-    fsm_state_t state = regex->prev_state;
-    if (GET_BIT(regex->flags, REGEX_QMARK_BIT)) {
-      fsm_set(&regex->fsm, state, *pattern, regex->fsm.count+1);
-      state = fsm_push_empty(&regex->fsm);
-    } else if (!GET_BIT(regex->flags, REGEX_PASSTHROUGH_BIT)) state = fsm_push_empty(&regex->fsm);
-    fsm_set(&regex->fsm, state, *pattern, regex->fsm.count);
-    regex->flags = 0;
-    SET_BIT(regex->flags, REGEX_SPECIAL_ALLOWED_BIT);
-    regex->prev_state = state;
+  case '[': return regex__parse_class(ast, pattern+1, end, node);
+  case '^': *node = regex__node(ast, (regex_node_t){ .kind = REGEX_NODE_BEGIN }); break;
+  case '$': *node = regex__node(ast, (regex_node_t){ .kind = REGEX_NODE_END }); break;
+  case '\\': {
+    ++pattern;
+    if (!*pattern) return false;
+    return regex__parse_literal(ast, pattern, end, node);
   }
+  case '\0': case ')': case '|': case '?': case '*': case '+': case '{': return false;
+  default: return regex__parse_literal(ast, pattern, end, node);
   }
   *end = ++pattern;
   return true;
 }
 
-bool regex_compile_bracket(regex_t *regex, const char *pattern, const char **end) {
-  SET_BIT(regex->flags, REGEX_BRACKET_BIT);
+bool regex__parse_count(const char *pattern, const char **end, uint32_t *count) {
+  if (*pattern < '0' || *pattern > '9') return false;
+  for (*count = 0; *pattern >= '0' && *pattern <= '9'; ++pattern) {
+    *count = *count*10 + (uint32_t)(*pattern - '0');
+    if (*count > REGEX_MAX_REPEAT) return false;
+  }
+  *end = pattern;
+  return true;
+}
 
-  fsm_state_t base = regex->fsm.count;
-  regex->prev_state = base;
-  while (*pattern && *pattern != ')') {
-    if (*pattern == '|') {
-      SET_BIT(regex->flags, REGEX_PASSTHROUGH_BIT);
-      ++pattern;
-    } else if (!regex_compile_expr(regex, pattern, &pattern)) return false;
+// {m}, {m,} and {m,n}
+bool regex__parse_bounds(const char *pattern, const char **end, regex_node_t *repeat) {
+  if (!regex__parse_count(pattern, &pattern, &repeat->min)) return false;
+  repeat->max = repeat->min;
+  if (*pattern == ',') {
+    ++pattern;
+    repeat->max = REGEX_UNBOUNDED;
+    if (*pattern != '}' && !regex__parse_count(pattern, &pattern, &repeat->max)) return false;
   }
-  if (*pattern != ')') return false;
+  if (*pattern != '}' || repeat->min > repeat->max) return false;
+  *end = pattern;
+  return true;
+}
 
-  CLEAR_BIT(regex->flags, REGEX_BRACKET_BIT);
-  regex->prev_state = base;
-  *end = ++pattern;
+bool regex__parse_repeat(regex_ast_t *ast, const char *pattern, const char **end, uint32_t *node, size_t depth) {
+  if (!regex__parse_atom(ast, pattern, &pattern, node, depth)) return false;
+  for (;; ++pattern) {
+    regex_node_t repeat = { .kind = REGEX_NODE_REPEAT, .lhs = *node };
+    switch (*pattern) {
+    case '?': repeat.min = 0; repeat.max = 1; break;
+    case '*': repeat.min = 0; repeat.max = REGEX_UNBOUNDED; break;
+    case '+': repeat.min = 1; repeat.max = REGEX_UNBOUNDED; break;
+    case '{': if (!regex__parse_bounds(pattern+1, &pattern, &repeat)) return false; break;
+    default: *end = pattern; return true;
+    }
+    *node = regex__node(ast, repeat);
+  }
+}
+
+bool regex__parse_concat(regex_ast_t *ast, const char *pattern, const char **end, uint32_t *node, size_t depth) {
+  *node = regex__node(ast, (regex_node_t){ .kind = REGEX_NODE_EMPTY });
+  bool empty = true;
+  while (*pattern && *pattern != '|' && *pattern != ')') {
+    uint32_t rhs;
+    if (!regex__parse_repeat(ast, pattern, &pattern, &rhs, depth)) return false;
+    *node = empty ? rhs : regex__pair(ast, REGEX_NODE_CONCAT, *node, rhs);
+    empty = false;
+  }
+  *end = pattern;
   return true;
 }
 
-bool regex_compile(regex_t *regex, const char *pattern) {
-  while (*pattern) if (!regex_compile_expr(regex, pattern, &pattern)) return false;
-  if (GET_BIT(regex->flags, REGEX_PASSTHROUGH_BIT)) fsm_set(&regex->fsm, regex->fsm.count-1, 0, regex->fsm.count);
+bool regex__parse_alternate(regex_ast_t *ast, const char *pattern, const char **end, uint32_t *node, size_t depth) {
+  if (!regex__parse_concat(ast, pattern, &pattern, node, depth)) return false;
+  while (*pattern == '|') {
+    uint32_t rhs;
+    if (!regex__parse_concat(ast, pattern+1, &pattern, &rhs, depth)) return false;
+    *node = regex__pair(ast, REGEX_NODE_ALTERNATE, *node, rhs);
+  }
+  *end = pattern;
   return true;
 }
 
+// How many states regex__nfa_compile makes for `node`, saturated at `limit`
+size_t regex__nfa_size(regex_ast_t ast, uint32_t node, size_t limit) {
+  regex_node_t n = ast.items[node];
+  size_t size = 0;
+  switch (n.kind) {
+  case REGEX_NODE_EMPTY: return 0;
+  case REGEX_NODE_RANGE: case REGEX_NODE_BEGIN: case REGEX_NODE_END: return 1;
+  case REGEX_NODE_CONCAT: case REGEX_NODE_ALTERNATE:
+    size = regex__nfa_size(ast, n.lhs, limit) + regex__nfa_size(ast, n.rhs, limit) + (n.kind == REGEX_NODE_ALTERNATE);
+    break;
+  case REGEX_NODE_REPEAT: {
+    // min copies of the body, then one more behind a split per optional copy
+    // (or a single looping one when unbounded)
+    size_t body = regex__nfa_size(ast, n.lhs, limit);
+    size_t optional = n.max == REGEX_UNBOUNDED ? 1 : n.max - n.min;
+    if (body > 0 && n.min > limit / body) return limit;
+    size = body * n.min;
+    if (optional > (limit - size) / (body + 1)) return limit;
+    size += optional * (body + 1);
+  } break;
+  }
+  return size < limit ? size : limit;
+}
+
+bool regex_parse(regex_ast_t *ast, const char *pattern) {
+  if (strncmp(pattern, "(?u)", 4) == 0) {
+    ast->utf8 = true;
+    pattern += 4;
+  }
+  if (!regex__parse_alternate(ast, pattern, &pattern, &ast->root, 0)) return false;
+  if (*pattern != '\0') return false;
+  return regex__nfa_size(*ast, ast->root, REGEX_MAX_NFA_STATES + 1) <= REGEX_MAX_NFA_STATES;
+}
+
+void regex_ast_free(regex_ast_t ast) {
+  free(ast.items);
+}
+
+// Required literals. For every node this works out what all of its matches
+// start and end with and a set of strings one of which occurs in each
+// match. Literals are capped at REGEX_MAX_LITERAL bytes, which only ever
+// makes them less selective.
+void regex__literal_append(regex_literal_t *lit, regex_literal_t tail, bool keep_front) {
+  uint8_t bytes[REGEX_MAX_LITERAL*2];
+  memcpy(bytes, lit->bytes, lit->len);
+  memcpy(bytes + lit->len, tail.bytes, tail.len);
+  size_t len = lit->len + tail.len;
+  size_t keep = len < REGEX_MAX_LITERAL ? len : REGEX_MAX_LITERAL;
+  memcpy(lit->bytes, keep_front ? bytes : bytes + len - keep, keep);
+  lit->len = keep;
+}
+
+regex_literal_t regex__literal_common(regex_literal_t a, regex_literal_t b, bool front) {
+  regex_literal_t common = {0};
+  size_t n = a.len < b.len ? a.len : b.len;
+  while (common.len < n) {
+    uint8_t x = front ? a.bytes[common.len] : a.bytes[a.len-1 - common.len];
+    uint8_t y = front ? b.bytes[common.len] : b.bytes[b.len-1 - common.len];
+    if (x != y) break;
+    ++common.len;
+  }
+  memcpy(common.bytes, front ? a.bytes : a.bytes + a.len - common.len, common.len);
+  return common;
+}
+
+// The shortest literal decides how often the set fires by accident
+size_t regex__literal_score(const regex_prefilter_t *info) {
+  if (info->any_count == 0) return 0;
+  size_t score = SIZE_MAX;
+  for (size_t i = 0; i < info->any_count; ++i) if (info->any[i].len < score) score = info->any[i].len;
+  return score;
+}
+
+void regex__literal_offer(regex_prefilter_t *info, regex_literal_t lit) {
+  if (lit.len == 0 || lit.len <= regex__literal_score(info)) return;
+  info->any[0] = lit;
+  info->any_count = 1;
+}
+
+void regex__literal_offer_set(regex_prefilter_t *info, const regex_prefilter_t *other) {
+  if (regex__literal_score(other) <= regex__literal_score(info)) return;
+  memcpy(info->any, other->any, sizeof(*other->any) * other->any_count);
+  info->any_count = other->any_count;
+}
+
+regex_prefilter_t regex__literals(regex_ast_t ast, uint32_t node) {
+  regex_node_t n = ast.items[node];
+  regex_prefilter_t info = {0};
+  switch (n.kind) {
+  case REGEX_NODE_EMPTY: case REGEX_NODE_BEGIN: case REGEX_NODE_END: {
+    info.exact = true;
+  } break;
+  case REGEX_NODE_RANGE: {
+    if (n.lo != n.hi) break;
+    info.exact = true;
+    info.prefix.bytes[0] = n.lo;
+    info.prefix.len = 1;
+    info.suffix = info.prefix;
+    info.any[info.any_count++] = info.prefix;
+  } break;
+  case REGEX_NODE_CONCAT: {
+    regex_prefilter_t lhs = regex__literals(ast, n.lhs), rhs = regex__literals(ast, n.rhs);
+    info.exact = lhs.exact && rhs.exact && lhs.prefix.len + rhs.prefix.len <= REGEX_MAX_LITERAL;
+    info.prefix = lhs.prefix;
+    if (lhs.exact) regex__literal_append(&info.prefix, rhs.prefix, true);
+    info.suffix = lhs.suffix;
+    if (rhs.exact) regex__literal_append(&info.suffix, rhs.suffix, false);
+    else info.suffix = rhs.suffix;
+    regex_literal_t join = lhs.suffix;
+    regex__literal_append(&join, rhs.prefix, true);
+    regex__literal_offer_set(&info, &lhs);
+    regex__literal_offer_set(&info, &rhs);
+    regex__literal_offer(&info, join);
+    regex__literal_offer(&info, info.prefix);
+    regex__literal_offer(&info, info.suffix);
+  } break;
+  case REGEX_NODE_ALTERNATE: {
+    regex_prefilter_t lhs = regex__literals(ast, n.lhs), rhs = regex__literals(ast, n.rhs);
+    info.prefix = regex__literal_common(lhs.prefix, rhs.prefix, true);
+    info.suffix = regex__literal_common(lhs.suffix, rhs.suffix, false);
+    info.exact = lhs.exact && rhs.exact && lhs.prefix.len == rhs.prefix.len && info.prefix.len == lhs.prefix.len;
+    if (lhs.any_count > 0 && rhs.any_count > 0 && lhs.any_count + rhs.any_count <= REGEX_MAX_LITERALS) {
+      memcpy(info.any, lhs.any, sizeof(*lhs.any) * lhs.any_count);
+      memcpy(info.any + lhs.any_count, rhs.any, sizeof(*rhs.any) * rhs.any_count);
+      info.any_count = lhs.any_count + rhs.any_count;
+    }
+    regex__literal_offer(&info, info.prefix);
+    regex__literal_offer(&info, info.suffix);
+  } break;
+  case REGEX_NODE_REPEAT: {
+    if (n.min == 0) break;
+    regex_prefilter_t body = regex__literals(ast, n.lhs);
+    if (n.min == 1 && n.max == 1) return body;
+    info.prefix = body.prefix;
+    info.suffix = body.suffix;
+    for (uint32_t i = 1; body.exact && i < n.min && info.prefix.len < REGEX_MAX_LITERAL; ++i) {
+      regex__literal_append(&info.prefix, body.prefix, true);
+      regex__literal_append(&info.suffix, body.suffix, false);
+    }
+    info.exact = body.exact && n.min == n.max && info.prefix.len == body.prefix.len * n.min;
+    regex__literal_offer_set(&info, &body);
+    regex__literal_offer(&info, info.prefix);
+    regex__literal_offer(&info, info.suffix);
+  } break;
+  }
+  return info;
+}
+
+// Leaves an empty prefilter (one that lets everything through) when the
+// pattern does not parse
+bool regex_prefilter_compile(regex_prefilter_t *prefilter, const char *pattern) {
+  memset(prefilter, 0, sizeof(*prefilter));
+  regex_ast_t ast = {0};
+  bool ok = regex_parse(&ast, pattern);
+  if (ok) *prefilter = regex__literals(ast, ast.root);
+  regex_ast_free(ast);
+  return ok;
+}
+
+// memchr does the skipping (it is vectorized in any libc worth using),
+// memcmp confirms. Returns the offset of the first occurrence or SIZE_MAX.
+size_t regex_find_literal(regex_literal_t lit, const uint8_t *text, size_t n) {
+  if (lit.len == 0) return 0;
+  if (lit.len > n) return SIZE_MAX;
+  const uint8_t *it = text, *last = text + n - lit.len;
+  while (it <= last && (it = memchr(it, lit.bytes[0], last - it + 1))) {
+    if (memcmp(it + 1, lit.bytes + 1, lit.len - 1) == 0) return it - text;
+    ++it;
+  }
+  return SIZE_MAX;
+}
+
+// Whether `text` as a whole may match. A false answer is final, so
+// regex_match only runs the automaton on inputs that pass.
+bool regex_prefilter_accepts(const regex_prefilter_t *prefilter, const uint8_t *text, size_t n) {
+  regex_literal_t prefix = prefilter->prefix, suffix = prefilter->suffix;
+  if (prefilter->exact) return n == prefix.len && memcmp(text, prefix.bytes, n) == 0;
+  if (n < prefix.len || memcmp(text, prefix.bytes, prefix.len) != 0) return false;
+  if (n < suffix.len || memcmp(text + n - suffix.len, suffix.bytes, suffix.len) != 0) return false;
+  if (prefilter->any_count == 0) return true;
+  for (size_t i = 0; i < prefilter->any_count; ++i) {
+    if (regex_find_literal(prefilter->any[i], text, n) != SIZE_MAX) return true;
+  }
+  return false;
+}
+
+// Thompson NFA. RANGE states consume one byte in [lo, hi] and go to `out`,
+// SPLIT states fork to `out` (preferred) and `out1` without consuming.
+// MATCH states keep the id of their pattern in `out`.
+typedef enum {
+  REGEX_NFA_RANGE,
+  REGEX_NFA_SPLIT,
+  REGEX_NFA_MATCH,
+  REGEX_NFA_BEGIN, // Only passable at the start of the text
+  REGEX_NFA_END,   // Only passable at the end of the text
+} regex_nfa_kind_t;
+
+typedef struct {
+  uint8_t kind;
+  uint8_t lo, hi;
+  uint32_t out, out1;
+} regex_nfa_state_t;
+
+typedef struct {
+  regex_nfa_state_t *items;
+  size_t count;
+  size_t capacity;
+  uint32_t start;
+} regex_nfa_t;
+
+uint32_t regex__nfa_push(regex_nfa_t *nfa, regex_nfa_state_t state) {
+  if (nfa->count >= nfa->capacity) {
+    nfa->capacity = nfa->capacity == 0 ? 16 : nfa->capacity*2;
+    nfa->items = realloc(nfa->items, sizeof(*nfa->items) * nfa->capacity);
+    assert(nfa->items && "Buy more RAM lol");
+  }
+  nfa->items[nfa->count] = state;
+  return (uint32_t)nfa->count++;
+}
+
+uint32_t regex__nfa_split(regex_nfa_t *nfa, uint32_t out, uint32_t out1) {
+  return regex__nfa_push(nfa, (regex_nfa_state_t){ .kind = REGEX_NFA_SPLIT, .out = out, .out1 = out1 });
+}
+
+// Compiles `node` back to front so every fragment already knows where it
+// continues. `reverse` builds the automaton for the reversed language.
+uint32_t regex__nfa_compile(regex_nfa_t *nfa, regex_ast_t ast, uint32_t node, uint32_t next, bool reverse) {
+  regex_node_t n = ast.items[node];
+  switch (n.kind) {
+  case REGEX_NODE_EMPTY: return next;
+  case REGEX_NODE_RANGE:
+    return regex__nfa_push(nfa, (regex_nfa_state_t){ .kind = REGEX_NFA_RANGE, .lo = n.lo, .hi = n.hi, .out = next });
+  case REGEX_NODE_BEGIN: case REGEX_NODE_END: {
+    // Reading backwards the text starts where it used to end
+    bool begin = (n.kind == REGEX_NODE_BEGIN) != reverse;
+    return regex__nfa_push(nfa, (regex_nfa_state_t){ .kind = begin ? REGEX_NFA_BEGIN : REGEX_NFA_END, .out = next });
+  }
+  case REGEX_NODE_CONCAT:
+    if (reverse) return regex__nfa_compile(nfa, ast, n.rhs, regex__nfa_compile(nfa, ast, n.lhs, next, reverse), reverse);
+    return regex__nfa_compile(nfa, ast, n.lhs, regex__nfa_compile(nfa, ast, n.rhs, next, reverse), reverse);
+  case REGEX_NODE_ALTERNATE: {
+    uint32_t lhs = regex__nfa_compile(nfa, ast, n.lhs, next, reverse);
+    uint32_t rhs = regex__nfa_compile(nfa, ast, n.rhs, next, reverse);
+    return regex__nfa_split(nfa, lhs, rhs);
+  }
+  case REGEX_NODE_REPEAT: {
+    uint32_t start = next;
+    if (n.max == REGEX_UNBOUNDED) {
+      start = regex__nfa_split(nfa, 0, next);
+      uint32_t body = regex__nfa_compile(nfa, ast, n.lhs, start, reverse);
+      nfa->items[start].out = body;
+    } else {
+      for (uint32_t i = n.min; i < n.max; ++i) start = regex__nfa_split(nfa, regex__nfa_compile(nfa, ast, n.lhs, start, reverse), start);
+    }
+    for (uint32_t i = 0; i < n.min; ++i) start = regex__nfa_compile(nfa, ast, n.lhs, start, reverse);
+    return start;
+  }
+  }
+  assert(0 && "unreachable");
+  return next;
+}
+
+// Adds `pattern` with a MATCH state of its own, tagged with `id`, and
+// returns where it starts in `start`
+bool regex__nfa_add(regex_nfa_t *nfa, const char *pattern, bool reverse, uint32_t id, uint32_t *start) {
+  regex_ast_t ast = {0};
+  bool ok = regex_parse(&ast, pattern);
+  if (ok) {
+    uint32_t match = regex__nfa_push(nfa, (regex_nfa_state_t){ .kind = REGEX_NFA_MATCH, .out = id });
+    *start = regex__nfa_compile(nfa, ast, ast.root, match, reverse);
+  }
+  regex_ast_free(ast);
+  return ok;
+}
+
+bool regex_nfa_compile(regex_nfa_t *nfa, const char *pattern, bool reverse) {
+  return regex__nfa_add(nfa, pattern, reverse, 0, &nfa->start);
+}
+
+void regex_nfa_free(regex_nfa_t nfa) {
+  free(nfa.items);
+}
+
+// Epsilon closures. DFA states stand for the list of RANGE/MATCH NFA states
+// reachable at that point, in priority order; SPLITs are only followed.
+// BEGIN is followed while `begin` is set and dropped otherwise, END is
+// followed while `end` is set and otherwise stays in the list until
+// regex__closure_end finds out whether the text stops there.
+typedef struct {
+  uint32_t *sparse, *dense, *stack; // One slot per NFA state
+  size_t dense_count;
+  uint32_t *list;
+  size_t list_count;
+  bool leftmost_first; // Drop whatever comes after a MATCH, it could only lose
+  bool begin, end;
+} regex_closure_t;
+
+void regex__closure_init(regex_closure_t *closure, const regex_nfa_t *nfa, bool leftmost_first) {
+  closure->sparse = calloc(nfa->count, sizeof(*closure->sparse));
+  closure->dense = malloc(sizeof(*closure->dense) * nfa->count);
+  closure->stack = malloc(sizeof(*closure->stack) * (nfa->count*2 + 1));
+  closure->list = malloc(sizeof(*closure->list) * nfa->count);
+  assert(closure->sparse && closure->dense && closure->stack && closure->list && "Buy more RAM lol");
+  closure->dense_count = 0;
+  closure->list_count = 0;
+  closure->leftmost_first = leftmost_first;
+  closure->begin = false;
+  closure->end = false;
+}
+
+void regex__closure_clear(regex_closure_t *closure) {
+  closure->dense_count = 0;
+  closure->list_count = 0;
+}
+
+// Adds everything reachable from `from` without consuming input. Returns
+// whether a MATCH cut the list short.
+bool regex__closure_add(regex_closure_t *closure, const regex_nfa_t *nfa, uint32_t from) {
+  size_t top = 0;
+  closure->stack[top++] = from;
+  while (top > 0) {
+    uint32_t s = closure->stack[--top];
+    uint32_t i = closure->sparse[s];
+    if (i < closure->dense_count && closure->dense[i] == s) continue;
+    closure->sparse[s] = (uint32_t)closure->dense_count;
+    closure->dense[closure->dense_count++] = s;
+    regex_nfa_state_t state = nfa->items[s];
+    if (state.kind == REGEX_NFA_SPLIT) {
+      closure->stack[top++] = state.out1;
+      closure->stack[top++] = state.out;
+    } else if (state.kind == REGEX_NFA_BEGIN) {
+      if (closure->begin) closure->stack[top++] = state.out;
+    } else if (state.kind == REGEX_NFA_END && closure->end) {
+      closure->stack[top++] = state.out;
+    } else {
+      closure->list[closure->list_count++] = s;
+      if (state.kind == REGEX_NFA_MATCH && closure->leftmost_first) return true;
+    }
+  }
+  return false;
+}
+
+// Replaces the list with where `from` goes on `byte`
+void regex__closure_step(regex_closure_t *closure, const regex_nfa_t *nfa, const uint32_t *from, size_t n, uint8_t byte) {
+  regex__closure_clear(closure);
+  for (size_t i = 0; i < n; ++i) {
+    regex_nfa_state_t state = nfa->items[from[i]];
+    if (state.kind != REGEX_NFA_RANGE || byte < state.lo || byte > state.hi) continue;
+    if (regex__closure_add(closure, nfa, state.out)) break;
+  }
+}
+
+// Replaces the list with what `from` reaches if the text ends right there.
+// A ^ after a $ is never passed, not even in an empty text.
+void regex__closure_end(regex_closure_t *closure, const regex_nfa_t *nfa, const uint32_t *from, size_t n) {
+  regex__closure_clear(closure);
+  closure->end = true;
+  for (size_t i = 0; i < n; ++i) if (regex__closure_add(closure, nfa, from[i])) break;
+  closure->end = false;
+}
+
+void regex__closure_free(regex_closure_t closure) {
+  free(closure.sparse);
+  free(closure.dense);
+  free(closure.stack);
+  free(closure.list);
+}
+
+// Interned uint32_t lists, numbered in insertion order. `index` is an open
+// addressing table that is kept at most half full.
+typedef struct {
+  uint32_t *pool;
+  size_t pool_count;
+  size_t pool_capacity;
+  size_t *offsets; // List i is pool[offsets[i] .. offsets[i+1]]
+  size_t count;
+  size_t capacity;
+  fsm_state_t *index;
+  size_t index_capacity;
+} regex_subsets_t;
+
+uint64_t regex__hash(const uint32_t *items, size_t n) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < n; ++i) hash = (hash ^ items[i]) * 1099511628211ULL;
+  return hash;
+}
+
+void regex__subsets_clear(regex_subsets_t *subsets) {
+  for (size_t i = 0; i < subsets->index_capacity; ++i) subsets->index[i] = FSM_NO_STATE;
+  subsets->pool_count = 0;
+  subsets->count = 0;
+  if (subsets->offsets) subsets->offsets[0] = 0;
+}
+
+void regex__subsets_reserve(regex_subsets_t *subsets, size_t capacity) {
+  if (capacity <= subsets->capacity) return;
+  subsets->offsets = realloc(subsets->offsets, sizeof(*subsets->offsets) * (capacity+1));
+  assert(subsets->offsets && "Buy more RAM lol");
+  if (subsets->capacity == 0) subsets->offsets[0] = 0;
+  subsets->capacity = capacity;
+
+  size_t index_capacity = 16;
+  while (index_capacity < capacity*2) index_capacity *= 2;
+  free(subsets->index);
+  subsets->index = malloc(sizeof(*subsets->index) * index_capacity);
+  assert(subsets->index && "Buy more RAM lol");
+  subsets->index_capacity = index_capacity;
+  for (size_t i = 0; i < index_capacity; ++i) subsets->index[i] = FSM_NO_STATE;
+  for (size_t id = 0; id < subsets->count; ++id) {
+    size_t start = subsets->offsets[id];
+    size_t slot = regex__hash(subsets->pool + start, subsets->offsets[id+1] - start) & (index_capacity-1);
+    while (subsets->index[slot] != FSM_NO_STATE) slot = (slot + 1) & (index_capacity-1);
+    subsets->index[slot] = (fsm_state_t)id;
+  }
+}
+
+// Returns the number of `list`, or FSM_NO_STATE with `slot` set to where it
+// would go
+fsm_state_t regex__subsets_find(const regex_subsets_t *subsets, const uint32_t *list, size_t n, size_t *slot) {
+  *slot = 0;
+  if (subsets->index_capacity == 0) return FSM_NO_STATE;
+  size_t mask = subsets->index_capacity - 1;
+  for (*slot = regex__hash(list, n) & mask; subsets->index[*slot] != FSM_NO_STATE; *slot = (*slot + 1) & mask) {
+    fsm_state_t id = subsets->index[*slot];
+    size_t start = subsets->offsets[id];
+    if (subsets->offsets[id+1] - start == n && (n == 0 || memcmp(subsets->pool + start, list, sizeof(*list) * n) == 0)) return id;
+  }
+  return FSM_NO_STATE;
+}
+
+fsm_state_t regex__subsets_insert(regex_subsets_t *subsets, const uint32_t *list, size_t n, size_t slot) {
+  if (subsets->count >= subsets->capacity) {
+    regex__subsets_reserve(subsets, subsets->capacity == 0 ? 64 : subsets->capacity*2);
+    (void)regex__subsets_find(subsets, list, n, &slot);
+  }
+  if (subsets->pool_count + n > subsets->pool_capacity) {
+    while (subsets->pool_count + n > subsets->pool_capacity) subsets->pool_capacity = subsets->pool_capacity == 0 ? 256 : subsets->pool_capacity*2;
+    subsets->pool = realloc(subsets->pool, sizeof(*subsets->pool) * subsets->pool_capacity);
+    assert(subsets->pool && "Buy more RAM lol");
+  }
+  if (n > 0) memcpy(subsets->pool + subsets->pool_count, list, sizeof(*list) * n);
+  subsets->pool_count += n;
+  subsets->offsets[++subsets->count] = subsets->pool_count;
+  subsets->index[slot] = (fsm_state_t)(subsets->count-1);
+  return (fsm_state_t)(subsets->count-1);
+}
+
+fsm_state_t regex__subsets_intern(regex_subsets_t *subsets, const uint32_t *list, size_t n) {
+  size_t slot;
+  fsm_state_t id = regex__subsets_find(subsets, list, n, &slot);
+  return id != FSM_NO_STATE ? id : regex__subsets_insert(subsets, list, n, slot);
+}
+
+void regex__subsets_free(regex_subsets_t subsets) {
+  free(subsets.pool);
+  free(subsets.offsets);
+  free(subsets.index);
+}
+
+bool regex__list_accepts(const regex_nfa_t *nfa, const uint32_t *list, size_t n) {
+  for (size_t i = 0; i < n; ++i) if (nfa->items[list[i]].kind == REGEX_NFA_MATCH) return true;
+  return false;
+}
+
+// Subset construction of everything reachable from `start`. DFA state i is
+// subsets->offsets list i, with the dead state (the empty list) as 0 and
+// dfa->state set to the start. States accept if the pattern matches when the
+// text ends in them. Only one step per byte class of the NFA is computed.
+// Fails once the DFA would need more than `max_states`.
+bool regex__determinize(const regex_nfa_t *nfa, uint32_t start, bool leftmost_first, size_t max_states, fsm_t *dfa, regex_subsets_t *subsets) {
+  bool boundary[257] = {0};
+  boundary[0] = boundary[256] = true;
+  for (size_t i = 0; i < nfa->count; ++i) {
+    if (nfa->items[i].kind != REGEX_NFA_RANGE) continue;
+    boundary[nfa->items[i].lo] = true;
+    boundary[nfa->items[i].hi + 1] = true;
+  }
+
+  regex_closure_t closure;
+  regex__closure_init(&closure, nfa, leftmost_first);
+  fsm_init(dfa, 256);
+  bool ok = true;
+  (void)regex__subsets_intern(subsets, NULL, 0);
+  fsm_push_empty(dfa);
+  fsm_set_dead(dfa, 0);
+  closure.begin = true;
+  regex__closure_add(&closure, nfa, start);
+  closure.begin = false;
+  dfa->state = regex__subsets_intern(subsets, closure.list, closure.list_count);
+  if (dfa->state >= dfa->count) fsm_push_empty(dfa);
+  for (fsm_state_t state = 0; ok && state < subsets->count; ++state) {
+    size_t from = subsets->offsets[state], n = subsets->offsets[state+1] - from;
+    regex__closure_end(&closure, nfa, subsets->pool + from, n);
+    fsm_set_accepting(dfa, state, regex__list_accepts(nfa, closure.list, closure.list_count));
+    for (size_t lo = 0, hi; lo < 256; lo = hi) {
+      for (hi = lo+1; !boundary[hi]; ++hi) {}
+      regex__closure_step(&closure, nfa, subsets->pool + subsets->offsets[state], n, (uint8_t)lo);
+      fsm_state_t to = regex__subsets_intern(subsets, closure.list, closure.list_count);
+      if (to >= max_states) {
+        ok = false;
+        break;
+      }
+      if (to >= dfa->count && fsm_push_empty(dfa) == FSM_NO_STATE) {
+        ok = false;
+        break;
+      }
+      for (size_t b = lo; b < hi; ++b) fsm_set(dfa, state, b, to);
+    }
+  }
+  regex__closure_free(closure);
+  return ok;
+}
+
+// Fully built, minimized DFA for whole-text matches. Patterns whose DFA
+// would need more than REGEX_MAX_STATES states do not compile; regex_lazy_t
+// handles those.
+#ifndef REGEX_MAX_STATES
+#define REGEX_MAX_STATES (1 << 16)
+#endif
+
+typedef struct {
+  fsm_t fsm;
+  fsm_state_t start;
+  regex_prefilter_t prefilter;
+} regex_t;
+
+void regex_init(regex_t *regex) {
+  fsm_init(&regex->fsm, 256);
+  fsm_push_empty(&regex->fsm);
+  regex->start = 0;
+}
+
+void regex_free(regex_t regex) {
+  if (fsm_initialized(regex.fsm)) fsm_free(regex.fsm);
+}
+
+// Parses the pattern, builds its Thompson NFA and determinizes that over
+// byte classes, so classes, counted repetition, anchors and groups all end
+// up as range transitions of a single table
+bool regex_compile(regex_t *regex, const char *pattern) {
+  regex_nfa_t nfa = {0};
+  if (!regex_nfa_compile(&nfa, pattern, false)) {
+    regex_nfa_free(nfa);
+    return false;
+  }
+  (void)regex_prefilter_compile(&regex->prefilter, pattern);
+
+  fsm_t dfa = {0};
+  regex_subsets_t subsets = {0};
+  bool ok = regex__determinize(&nfa, nfa.start, false, REGEX_MAX_STATES, &dfa, &subsets);
+  regex__subsets_free(subsets);
+  regex_nfa_free(nfa);
+  fsm_t min = {0};
+  ok = ok && fsm_minimize(dfa, &min, NULL);
+  if (ok) {
+    regex->start = min.state;
+    fsm_free(regex->fsm);
+    regex->fsm = min;
+    (void)fsm_compress_events(&regex->fsm);
+    (void)fsm_compact(&regex->fsm);
+  }
+  if (fsm_initialized(dfa)) fsm_free(dfa);
+  return ok;
+}
+
 bool regex_match(regex_t *regex, const char *text) {
-  regex->fsm.state = 1;
-  while (*text && regex->fsm.state > 0
-      && regex->fsm.state < regex->fsm.count)
-    (void)fsm_fire_event(&regex->fsm, *(text++));
+  size_t len = strlen(text);
+  if (!regex_prefilter_accepts(&regex->prefilter, (const uint8_t*)text, len)) return false;
+  regex->fsm.state = regex->start;
+  fsm_run_t run = fsm_run_bytes(&regex->fsm, (const uint8_t*)text, len);
+  return run.consumed == len && fsm_is_accepting(regex->fsm, run.state);
+}
+
+// Lazily built DFA. Transitions that have not been computed yet point past
+// the table (REGEX_CACHE_STATES + source), so fsm_run_bytes drops out of its
+// loop exactly when work is needed.
+#ifndef REGEX_CACHE_STATES
+#define REGEX_CACHE_STATES 1024
+#endif
+
+#define REGEX_CACHE_UNKNOWN(state) ((fsm_state_t)(REGEX_CACHE_STATES + (state)))
+
+typedef struct {
+  fsm_t fsm;
+  regex_subsets_t subsets; // Cached state i is list i
+  regex_closure_t closure;
+  uint32_t start;
+  size_t flushes;
+} regex_cache_t;
+
+fsm_state_t regex__cache_add(regex_cache_t *cache, const regex_nfa_t *nfa, size_t slot) {
+  const uint32_t *list = cache->closure.list;
+  size_t n = cache->closure.list_count;
+  fsm_state_t state = fsm_push_empty(&cache->fsm);
+  assert(state != FSM_NO_STATE && "Buy more RAM lol");
+  // The empty list is the dead state and can only ever go back to itself
+  fsm_state_t unknown = n == 0 ? state : REGEX_CACHE_UNKNOWN(state);
+  for (size_t b = 0; b < 256; ++b) fsm_set(&cache->fsm, state, b, unknown);
+  fsm_set_accepting(&cache->fsm, state, regex__list_accepts(nfa, list, n));
+  fsm_state_t id = regex__subsets_insert(&cache->subsets, list, n, slot);
+  assert(id == state);
+  (void)id;
+  return state;
+}
+
+void regex__cache_flush(regex_cache_t *cache, const regex_nfa_t *nfa) {
+  fsm_clear(&cache->fsm);
+  regex__subsets_clear(&cache->subsets);
+  size_t slot;
+  (void)regex__subsets_find(&cache->subsets, NULL, 0, &slot);
+  size_t list_count = cache->closure.list_count;
+  cache->closure.list_count = 0;
+  fsm_set_dead(&cache->fsm, regex__cache_add(cache, nfa, slot));
+  cache->closure.list_count = list_count;
+  ++cache->flushes;
+}
+
+// Finds or creates the cached state for the closure list. Throws away the
+// whole cache first when it is full, so earlier state numbers may go stale.
+fsm_state_t regex__cache_intern(regex_cache_t *cache, const regex_nfa_t *nfa) {
+  const uint32_t *list = cache->closure.list;
+  size_t n = cache->closure.list_count, slot;
+  fsm_state_t state = regex__subsets_find(&cache->subsets, list, n, &slot);
+  if (state != FSM_NO_STATE) return state;
+  if (cache->fsm.count >= REGEX_CACHE_STATES) {
+    regex__cache_flush(cache, nfa);
+    (void)regex__subsets_find(&cache->subsets, list, n, &slot);
+  }
+  return regex__cache_add(cache, nfa, slot);
+}
+
+// `begin` tells whether the text starts where the run does, which is what
+// decides if ^ can match
+fsm_state_t regex__cache_start(regex_cache_t *cache, const regex_nfa_t *nfa, bool begin) {
+  regex__closure_clear(&cache->closure);
+  cache->closure.begin = begin;
+  regex__closure_add(&cache->closure, nfa, cache->start);
+  cache->closure.begin = false;
+  return regex__cache_intern(cache, nfa);
+}
+
+// Accepting cached states match with more text to come. At the end of the
+// text $ holds as well, which may turn on a few more.
+bool regex__cache_accepts_at_end(regex_cache_t *cache, const regex_nfa_t *nfa, fsm_state_t state) {
+  if (fsm_is_accepting(cache->fsm, state)) return true;
+  const regex_subsets_t *subsets = &cache->subsets;
+  size_t from = subsets->offsets[state];
+  regex__closure_end(&cache->closure, nfa, subsets->pool + from, subsets->offsets[state+1] - from);
+  return regex__list_accepts(nfa, cache->closure.list, cache->closure.list_count);
+}
+
+// Computes the transition of `from` on `byte` and records it in the table
+fsm_state_t regex__cache_step(regex_cache_t *cache, const regex_nfa_t *nfa, fsm_state_t from, uint8_t byte) {
+  const regex_subsets_t *subsets = &cache->subsets;
+  size_t start = subsets->offsets[from];
+  regex__closure_step(&cache->closure, nfa, subsets->pool + start, subsets->offsets[from+1] - start, byte);
+  size_t flushes = cache->flushes;
+  fsm_state_t to = regex__cache_intern(cache, nfa);
+  if (cache->flushes == flushes) fsm_set(&cache->fsm, from, byte, to);
+  return to;
+}
+
+fsm_state_t regex__cache_next(regex_cache_t *cache, const regex_nfa_t *nfa, fsm_state_t from, uint8_t byte) {
+  fsm_state_t to = fsm_get(cache->fsm, from, byte);
+  return to < cache->fsm.count ? to : regex__cache_step(cache, nfa, from, byte);
+}
+
+// Runs the cached DFA from `state` until the input is used up or the dead
+// state is reached, filling in missing transitions on the way
+fsm_state_t regex__cache_run(regex_cache_t *cache, const regex_nfa_t *nfa, fsm_state_t state, const uint8_t *bytes, size_t n) {
+  while (n > 0) {
+    cache->fsm.state = state;
+    fsm_run_t run = fsm_run_bytes(&cache->fsm, bytes, n);
+    bytes += run.consumed;
+    n -= run.consumed;
+    if (run.state < cache->fsm.count) return run.state;
+    state = regex__cache_step(cache, nfa, run.state - REGEX_CACHE_STATES, bytes[-1]);
+  }
+  return state;
+}
+
+// Like regex__cache_run, but returns how many bytes had been consumed the
+// last time the DFA was in an accepting state, or SIZE_MAX if it never was.
+// `at_end` tells whether the text really ends after the n bytes.
+size_t regex__cache_last_match(regex_cache_t *cache, const regex_nfa_t *nfa, fsm_state_t state, const uint8_t *bytes, size_t n, bool at_end) {
+  size_t last = SIZE_MAX, i = 0;
+  for (;;) {
+    if (fsm_is_accepting(cache->fsm, state)) {
+      last = i;
+      if (i == n) break;
+      state = regex__cache_next(cache, nfa, state, bytes[i++]);
+      continue;
+    }
+    if (i == n || fsm_is_dead(cache->fsm, state)) break;
+    cache->fsm.state = state;
+    fsm_run_t run = fsm_scan_bytes(&cache->fsm, bytes + i, n - i);
+    i += run.consumed;
+    state = run.state < cache->fsm.count ? run.state : regex__cache_step(cache, nfa, run.state - REGEX_CACHE_STATES, bytes[i-1]);
+  }
+  if (at_end && i == n && last != n && regex__cache_accepts_at_end(cache, nfa, state)) last = n;
+  return last;
+}
+
+// Same, walking from bytes[n-1] down to bytes[0]
+size_t regex__cache_last_match_reverse(regex_cache_t *cache, const regex_nfa_t *nfa, fsm_state_t state, const uint8_t *bytes, size_t n, bool at_end) {
+  size_t last = SIZE_MAX;
+  for (size_t i = 0; !fsm_is_dead(cache->fsm, state); ++i) {
+    if (i == n) {
+      if (at_end ? regex__cache_accepts_at_end(cache, nfa, state) : fsm_is_accepting(cache->fsm, state)) last = i;
+      break;
+    }
+    if (fsm_is_accepting(cache->fsm, state)) last = i;
+    state = regex__cache_next(cache, nfa, state, bytes[n-1 - i]);
+  }
+  return last;
+}
+
+regex_cache_t *regex__cache_new(const regex_nfa_t *nfa, uint32_t start, bool leftmost_first) {
+  regex_cache_t *cache = calloc(1, sizeof(*cache));
+  assert(cache && "Buy more RAM lol");
+  fsm_init(&cache->fsm, 256);
+  bool reserved = fsm_reserve(&cache->fsm, REGEX_CACHE_STATES);
+  assert(reserved && "Buy more RAM lol");
+  (void)reserved;
+  regex__subsets_reserve(&cache->subsets, REGEX_CACHE_STATES);
+  regex__closure_init(&cache->closure, nfa, leftmost_first);
+  cache->start = start;
+  regex__cache_flush(cache, nfa);
+  cache->flushes = 0;
+  return cache;
+}
+
+void regex__cache_free(regex_cache_t *cache) {
+  if (!cache) return;
+  fsm_free(cache->fsm);
+  regex__subsets_free(cache->subsets);
+  regex__closure_free(cache->closure);
+  free(cache);
+}
+
+typedef enum {
+  REGEX_LEFTMOST_FIRST,   // Earlier alternatives win, like backtracking engines
+  REGEX_LEFTMOST_LONGEST, // The longest match at the leftmost start, like POSIX
+} regex_semantics_t;
+
+// Regex engine that never builds more than REGEX_CACHE_STATES DFA states
+// per cache, so patterns whose DFA would blow up still match in bounded
+// memory. The search caches are only created by the first regex_find.
+typedef struct {
+  regex_nfa_t nfa;         // Also holds the unanchored loop at search_start
+  regex_nfa_t reverse;
+  regex_cache_t *cache;    // Anchored: whole matches and longest ends
+  regex_cache_t *search;   // Unanchored leftmost-first: match ends
+  regex_cache_t *backward; // Reversed pattern, anchored at an end: starts
+  uint32_t search_start;
+  regex_prefilter_t prefilter;
+  regex_semantics_t semantics;
+} regex_lazy_t;
 
-  if (regex->fsm.state == 0 || *text) return false;
-  else if (regex->fsm.state >= regex->fsm.count) return true;
-  else (void)fsm_fire_event(&regex->fsm, 0);
+typedef struct {
+  size_t start;
+  size_t end;
+} regex_span_t;
+
+bool regex_lazy_compile(regex_lazy_t *regex, const char *pattern) {
+  if (!regex_nfa_compile(&regex->nfa, pattern, false)) return false;
+  bool reversed = regex_nfa_compile(&regex->reverse, pattern, true);
+  assert(reversed);
+  (void)reversed;
+  (void)regex_prefilter_compile(&regex->prefilter, pattern);
+
+  // Searching prepends a lazy .* that loses against the pattern itself
+  regex->search_start = regex__nfa_split(&regex->nfa, regex->nfa.start, 0);
+  uint32_t any = regex__nfa_push(&regex->nfa, (regex_nfa_state_t){ .kind = REGEX_NFA_RANGE, .lo = 0, .hi = 255, .out = regex->search_start });
+  regex->nfa.items[regex->search_start].out1 = any;
+  regex->cache = regex__cache_new(&regex->nfa, regex->nfa.start, false);
+  return true;
+}
+
+bool regex_lazy_match(regex_lazy_t *regex, const char *text) {
+  size_t len = strlen(text);
+  if (!regex_prefilter_accepts(&regex->prefilter, (const uint8_t*)text, len)) return false;
+  fsm_state_t state = regex__cache_start(regex->cache, &regex->nfa, true);
+  state = regex__cache_run(regex->cache, &regex->nfa, state, (const uint8_t*)text, len);
+  return regex__cache_accepts_at_end(regex->cache, &regex->nfa, state);
+}
+
+// Finds the first match that starts at or after `from`. The forward pass
+// over the unanchored pattern finds where the leftmost-first match ends,
+// the reversed pattern walked back from there finds where it starts, and
+// for leftmost-longest an anchored pass from that start finds the longest
+// end. Only the first pass looks at bytes beyond the match.
+bool regex_find(regex_lazy_t *regex, const char *text, size_t len, size_t from, regex_span_t *span) {
+  assert(from <= len);
+  const uint8_t *bytes = (const uint8_t*)text;
+  if (regex->prefilter.prefix.len > 0) {
+    size_t skip = regex_find_literal(regex->prefilter.prefix, bytes + from, len - from);
+    if (skip == SIZE_MAX) return false;
+    from += skip;
+  }
+  if (!regex->search) regex->search = regex__cache_new(&regex->nfa, regex->search_start, true);
+  if (!regex->backward) regex->backward = regex__cache_new(&regex->reverse, regex->reverse.start, false);
+
+  fsm_state_t state = regex__cache_start(regex->search, &regex->nfa, from == 0);
+  size_t end = regex__cache_last_match(regex->search, &regex->nfa, state, bytes + from, len - from, true);
+  if (end == SIZE_MAX) return false;
+  end += from;
+
+  state = regex__cache_start(regex->backward, &regex->reverse, end == len);
+  size_t back = regex__cache_last_match_reverse(regex->backward, &regex->reverse, state, bytes + from, end - from, from == 0);
+  assert(back != SIZE_MAX);
+  span->start = end - back;
+  span->end = end;
+
+  if (regex->semantics == REGEX_LEFTMOST_LONGEST) {
+    state = regex__cache_start(regex->cache, &regex->nfa, span->start == 0);
+    span->end = span->start + regex__cache_last_match(regex->cache, &regex->nfa, state, bytes + span->start, len - span->start, true);
+  }
+  return true;
+}
+
+// Collects up to `capacity` non-overlapping matches, left to right, and
+// returns how many were stored. An empty match moves the search on by a
+// byte so it cannot be found again.
+size_t regex_find_all(regex_lazy_t *regex, const char *text, size_t len, regex_span_t *spans, size_t capacity) {
+  size_t count = 0, from = 0;
+  while (count < capacity && from <= len && regex_find(regex, text, len, from, &spans[count])) {
+    regex_span_t span = spans[count++];
+    from = span.end > span.start ? span.end : span.end + 1;
+  }
+  return count;
+}
+
+void regex_lazy_free(regex_lazy_t regex) {
+  regex_nfa_free(regex.nfa);
+  regex_nfa_free(regex.reverse);
+  regex__cache_free(regex.cache);
+  regex__cache_free(regex.search);
+  regex__cache_free(regex.backward);
+}
+
+// Any number of patterns determinized together. Reaching a state means the
+// patterns in its bitset matched: match_index[state] picks one of the
+// distinct bitsets in `matches` (`words` uint64_t each), 0 being the empty
+// one, so states share their accept metadata instead of carrying a copy.
+// end_index[state] does the same for when the text ends there, which is
+// where patterns ending in $ show up.
+#ifndef REGEX_SET_MAX_STATES
+#define REGEX_SET_MAX_STATES (1 << 16)
+#endif
+
+typedef struct {
+  fsm_t fsm;
+  fsm_state_t start;
+  size_t pattern_count;
+  size_t words;
+  uint64_t *matches;
+  uint32_t *match_index;
+  uint32_t *end_index;
+  bool unanchored;
+} regex_set_t;
+
+int regex__compare_ids(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+  return (x > y) - (x < y);
+}
+
+// Unanchored sets report every pattern that matches somewhere in the text,
+// anchored ones only those matching all of it. Fails if a pattern does not
+// parse or the DFA needs more than REGEX_SET_MAX_STATES states.
+bool regex_set_compile(regex_set_t *set, const char *const *patterns, size_t count, bool unanchored) {
+  if (count == 0) return false;
+  regex_nfa_t nfa = {0};
+  uint32_t start = 0;
+  bool ok = true;
+  for (size_t i = 0; ok && i < count; ++i) {
+    uint32_t pattern_start;
+    ok = regex__nfa_add(&nfa, patterns[i], false, (uint32_t)i, &pattern_start);
+    start = i == 0 ? pattern_start : regex__nfa_split(&nfa, start, pattern_start);
+  }
+  if (ok && unanchored) {
+    start = regex__nfa_split(&nfa, start, 0);
+    uint32_t any = regex__nfa_push(&nfa, (regex_nfa_state_t){ .kind = REGEX_NFA_RANGE, .lo = 0, .hi = 255, .out = start });
+    nfa.items[start].out1 = any;
+  }
+
+  fsm_t dfa = {0};
+  regex_subsets_t subsets = {0};
+  ok = ok && regex__determinize(&nfa, start, false, REGEX_SET_MAX_STATES, &dfa, &subsets);
+  if (ok) {
+    regex_subsets_t distinct = {0};
+    (void)regex__subsets_intern(&distinct, NULL, 0);
+    uint32_t *ids = malloc(sizeof(*ids) * (count + 1));
+    set->match_index = malloc(sizeof(*set->match_index) * dfa.count);
+    set->end_index = malloc(sizeof(*set->end_index) * dfa.count);
+    assert(ids && set->match_index && set->end_index && "Buy more RAM lol");
+    regex_closure_t closure;
+    regex__closure_init(&closure, &nfa, false);
+    for (fsm_state_t state = 0; state < dfa.count; ++state) {
+      const uint32_t *list = subsets.pool + subsets.offsets[state];
+      size_t list_count = subsets.offsets[state+1] - subsets.offsets[state];
+      for (int end = 0; end < 2; ++end) {
+        if (end) {
+          regex__closure_end(&closure, &nfa, list, list_count);
+          list = closure.list;
+          list_count = closure.list_count;
+        }
+        size_t n = 0;
+        for (size_t i = 0; i < list_count; ++i) {
+          regex_nfa_state_t s = nfa.items[list[i]];
+          if (s.kind == REGEX_NFA_MATCH) ids[n++] = s.out;
+        }
+        qsort(ids, n, sizeof(*ids), regex__compare_ids);
+        (end ? set->end_index : set->match_index)[state] = regex__subsets_intern(&distinct, ids, n);
+      }
+    }
+    regex__closure_free(closure);
+
+    set->pattern_count = count;
+    set->words = (count + 63) / 64;
+    set->matches = calloc(distinct.count * set->words, sizeof(*set->matches));
+    assert(set->matches && "Buy more RAM lol");
+    for (size_t d = 0; d < distinct.count; ++d) {
+      for (size_t i = distinct.offsets[d]; i < distinct.offsets[d+1]; ++i) {
+        uint32_t id = distinct.pool[i];
+        set->matches[d*set->words + id/64] |= 1ULL << id%64;
+      }
+    }
+    for (fsm_state_t state = 0; state < dfa.count; ++state) {
+      fsm_set_accepting(&dfa, state, (unanchored ? set->match_index : set->end_index)[state] != 0);
+    }
+    free(ids);
+    regex__subsets_free(distinct);
+
+    set->fsm = dfa;
+    set->start = dfa.state;
+    set->unanchored = unanchored;
+    (void)fsm_compress_events(&set->fsm);
+    (void)fsm_compact(&set->fsm);
+  } else if (fsm_initialized(dfa)) fsm_free(dfa);
+  regex__subsets_free(subsets);
+  regex_nfa_free(nfa);
+  return ok;
+}
+
+void regex__set_collect(const regex_set_t *set, const uint32_t *index, fsm_state_t state, uint64_t *matched) {
+  const uint64_t *bits = set->matches + index[state] * set->words;
+  for (size_t i = 0; i < set->words; ++i) matched[i] |= bits[i];
+}
+
+// Sets the bit of every pattern that matches in `matched`, which holds
+// set->words words, and returns how many did. The text is read once no
+// matter how many patterns there are.
+size_t regex_set_match(regex_set_t *set, const char *text, size_t len, uint64_t *matched) {
+  const uint8_t *bytes = (const uint8_t*)text;
+  memset(matched, 0, sizeof(*matched) * set->words);
+  set->fsm.state = set->start;
+  if (!set->unanchored) {
+    fsm_run_t run = fsm_run_bytes(&set->fsm, bytes, len);
+    if (run.consumed == len) regex__set_collect(set, set->end_index, run.state, matched);
+  } else {
+    // Accepting states only show up where a pattern has just matched, so
+    // the scan loop stays in fsm_scan_bytes for everything in between
+    for (size_t i = 0;;) {
+      fsm_run_t run = fsm_scan_bytes(&set->fsm, bytes + i, len - i);
+      i += run.consumed;
+      if (fsm_is_dead(set->fsm, run.state)) break;
+      if (i == len) {
+        regex__set_collect(set, set->end_index, run.state, matched);
+        break;
+      }
+      regex__set_collect(set, set->match_index, run.state, matched);
+      fsm_fire_event(&set->fsm, bytes[i++]);
+    }
+  }
+  size_t count = 0;
+  for (size_t i = 0; i < set->words; ++i) count += __builtin_popcountll(matched[i]);
+  return count;
+}
+
+void regex_set_free(regex_set_t set) {
+  if (fsm_initialized(set.fsm)) fsm_free(set.fsm);
+  free(set.matches);
+  free(set.match_index);
+  free(set.end_index);
+}
+
+// Resumable matching over a regex_set_t (a one-pattern set being the plain
+// case), for input that arrives in chunks of any size, NULs included. Only
+// the DFA state and the offset survive between chunks, so nothing is copied.
+// Matches are reported by where they end, since finding starts would need
+// text the stream no longer has. Streams only borrow the set, any number of
+// them can take turns on it.
+typedef void (*regex_report_t)(void *user, uint32_t pattern, size_t end);
+
+typedef struct {
+  regex_set_t *set;
+  fsm_state_t state;
+  size_t offset;
+} regex_stream_t;
+
+regex_stream_t regex_stream(regex_set_t *set) {
+  return (regex_stream_t){ .set = set, .state = set->start, .offset = 0 };
+}
+
+size_t regex__stream_report(const regex_set_t *set, const uint32_t *index, fsm_state_t state, size_t end, regex_report_t report, void *user) {
+  const uint64_t *bits = set->matches + index[state] * set->words;
+  size_t found = 0;
+  for (size_t i = 0; i < set->words; ++i) {
+    for (uint64_t word = bits[i]; word != 0; word &= word - 1, ++found) {
+      if (report) report(user, (uint32_t)(i*64 + __builtin_ctzll(word)), end);
+    }
+  }
+  return found;
+}
+
+// Unanchored sets report each match as soon as nothing after it can change
+// it: a match ending at offset e is reported by the feed that holds byte e,
+// or by regex_stream_finish. Anchored sets only report from
+// regex_stream_finish. Returns how many matches were reported.
+size_t regex_stream_feed(regex_stream_t *stream, const void *buf, size_t len, regex_report_t report, void *user) {
+  regex_set_t *set = stream->set;
+  const uint8_t *bytes = buf;
+  size_t found = 0;
+  set->fsm.state = stream->state;
+  if (!set->unanchored) (void)fsm_run_bytes(&set->fsm, bytes, len);
+  else {
+    for (size_t i = 0;;) {
+      fsm_run_t run = fsm_scan_bytes(&set->fsm, bytes + i, len - i);
+      i += run.consumed;
+      if (i == len || fsm_is_dead(set->fsm, run.state)) break;
+      found += regex__stream_report(set, set->match_index, run.state, stream->offset + i, report, user);
+      fsm_fire_event(&set->fsm, bytes[i++]);
+    }
+  }
+  stream->state = set->fsm.state;
+  stream->offset += len;
+  return found;
+}
 
-  return regex->fsm.state >= regex->fsm.count;
+// Reports what matches at the end of the text, $ included, and rewinds the
+// stream so it can be fed a new text
+size_t regex_stream_finish(regex_stream_t *stream, regex_report_t report, void *user) {
+  size_t found = regex__stream_report(stream->set, stream->set->end_index, stream->state, stream->offset, report, user);
+  *stream = regex_stream(stream->set);
+  return found;
+}
+
+// Leaves the engines to programs that include this file, like bench/bench.c
+#ifndef REGEX_NO_MAIN
+void regex_print_match(void *user, uint32_t pattern, size_t end) {
+  printf("%zu: %s\n", end, ((char**)user)[pattern]);
+}
+
+// Appends "pattern@end" to the string in `user`, which has room for 256
+void regex_record_match(void *user, uint32_t pattern, size_t end) {
+  char *record = user;
+  size_t at = strlen(record);
+  snprintf(record + at, 256 - at, "%s%u@%zu", at > 0 ? " " : "", pattern, end);
 }
 
 int main(int argc, char **argv) {
@@ -168,11 +1426,88 @@ int main(int argc, char **argv) {
     if (!regex_match(&regex, text)) printf("n't");
     printf(" match \"%s\"\n", pattern);
     return 0;
+  } else if ((argc == 3 || argc == 4) && strcmp(argv[1], "find") == 0) {
+    regex_lazy_t regex = {0};
+    if (!regex_lazy_compile(&regex, argv[2])) {
+      fprintf(stderr, "Failed to compile regex!\n");
+      return 1;
+    }
+    if (argc == 4 && strcmp(argv[3], "longest") == 0) regex.semantics = REGEX_LEFTMOST_LONGEST;
+
+    char line[4096];
+    while (fgets(line, sizeof(line), stdin)) {
+      size_t len = strcspn(line, "\n");
+      regex_span_t span;
+      for (size_t from = 0; from <= len && regex_find(&regex, line, len, from, &span);) {
+        printf("%zu..%zu: %.*s\n", span.start, span.end, (int)(span.end - span.start), line + span.start);
+        from = span.end > span.start ? span.end : span.end + 1;
+      }
+    }
+    regex_lazy_free(regex);
+    return 0;
+  } else if (argc >= 3 && strcmp(argv[1], "set") == 0) {
+    regex_set_t set = {0};
+    if (!regex_set_compile(&set, (const char *const *)argv + 2, argc - 2, true)) {
+      fprintf(stderr, "Failed to compile regex set!\n");
+      return 1;
+    }
+
+    uint64_t *matched = malloc(sizeof(*matched) * set.words);
+    assert(matched && "Buy more RAM lol");
+    char line[4096];
+    while (fgets(line, sizeof(line), stdin)) {
+      size_t len = strcspn(line, "\n");
+      if (regex_set_match(&set, line, len, matched) == 0) continue;
+      printf("%.*s:", (int)len, line);
+      for (size_t i = 0; i < set.pattern_count; ++i) {
+        if (matched[i/64] >> i%64 & 1) printf(" %s", argv[2 + i]);
+      }
+      printf("\n");
+    }
+    free(matched);
+    regex_set_free(set);
+    return 0;
+  } else if (argc >= 3 && strcmp(argv[1], "stream") == 0) {
+    regex_set_t set = {0};
+    if (!regex_set_compile(&set, (const char *const *)argv + 2, argc - 2, true)) {
+      fprintf(stderr, "Failed to compile regex set!\n");
+      return 1;
+    }
+
+    regex_stream_t stream = regex_stream(&set);
+    static uint8_t chunk[1 << 16];
+    for (size_t n; (n = fread(chunk, 1, sizeof(chunk), stdin)) > 0;) {
+      (void)regex_stream_feed(&stream, chunk, n, regex_print_match, argv + 2);
+    }
+    (void)regex_stream_finish(&stream, regex_print_match, argv + 2);
+    regex_set_free(set);
+    return 0;
+  } else if ((argc == 4 || argc == 5) && strcmp(argv[1], "emit") == 0) {
+    regex_t regex = {0};
+    regex_init(&regex);
+    if (!regex_compile(&regex, argv[2])) {
+      fprintf(stderr, "Failed to compile regex!\n");
+      return 1;
+    }
+
+    fsm_emit_t mode = argc == 5 && strcmp(argv[4], "switch") == 0 ? FSM_EMIT_SWITCH : FSM_EMIT_TABLE;
+    regex.fsm.state = regex.start;
+    bool emitted = fsm_emit_c(regex.fsm, stdout, argv[3], mode);
+    regex_free(regex);
+    if (!emitted) {
+      fprintf(stderr, "Failed to emit C, is %s a C identifier?\n", argv[3]);
+      return 1;
+    }
+    return 0;
   } else {
     typedef struct {
       const char *pattern;
       const char *text;
       bool expected;
+      // Find cases: every match regex_find_all reports, as "start..end"
+      // separated by spaces, instead of `expected`
+      const char *spans;
+      bool longest;
     } test_t;
     test_t tests[] = {
       (test_t){
@@ -379,6 +1714,171 @@ int main(int argc, char **argv) {
         .text = "ac",
         .expected = false
       },
+
+      (test_t){
+        .pattern = "a.c",
+        .text = "a\tc",
+        .expected = true
+      },
+      (test_t){
+        .pattern = "a.c",
+        .text = "a\xff" "c",
+        .expected = true
+      },
+      (test_t){
+        .pattern = "caf..",
+        .text = "caf\xc3\xa9",
+        .expected = true
+      },
+      (test_t){
+        .pattern = "(?u)caf.",
+        .text = "caf\xc3\xa9",
+        .expected = true
+      },
+      (test_t){
+        .pattern = "(?u)caf.",
+        .text = "caf\xc3",
+        .expected = false
+      },
+      (test_t){
+        .pattern = "(?u)\xc3\xa9+",
+        .text = "\xc3\xa9\xc3\xa9",
+        .expected = true
+      },
+      (test_t){
+        .pattern = "(?u)...",
+        .text = "\xe6\x97\xa5\xe6\x9c\xac\xe8\xaa\x9e",
+        .expected = true
+      },
+      (test_t){
+        .pattern = "(?u).",
+        .text = "\xed\xa0\x80",
+        .expected = false
+      },
+
+      (test_t){
+        .pattern = "[a-z]+",
+        .text = "hello",
+        .expected = true
+      },
+      (test_t){
+        .pattern = "[a-z]+",
+        .text = "Hello",
+        .expected = false
+      },
+      (test_t){
+        .pattern = "[^0-9]*",
+        .text = "abc",
+        .expected = true
+      },
+      (test_t){
+        .pattern = "[^0-9]*",
+        .text = "a1",
+        .expected = false
+      },
+      (test_t){
+        .pattern = "[]a-]+",
+        .text = "]-a",
+        .expected = true
+      },
+      (test_t){
+        .pattern = "(?u)[\xd0\xb0-\xd1\x8f]+",
+        .text = "\xd0\xbf\xd1\x80\xd0\xb8",
+        .expected = true
+      },
+      (test_t){
+        .pattern = "a{2,3}",
+        .text = "aaa",
+        .expected = true
+      },
+      (test_t){
+        .pattern = "a{2,3}",
+        .text = "aaaa",
+        .expected = false
+      },
+      (test_t){
+        .pattern = "a{2}",
+        .text = "a",
+        .expected = false
+      },
+      (test_t){
+        .pattern = "a{2,}",
+        .text = "aaaaa",
+        .expected = true
+      },
+      (test_t){
+        .pattern = "((a|b)c){2}d",
+        .text = "acbcd",
+        .expected = true
+      },
+      (test_t){
+        .pattern = "((a|b)c){2}d",
+        .text = "acd",
+        .expected = false
+      },
+      (test_t){
+        .pattern = "^ab$",
+        .text = "ab",
+        .expected = true
+      },
+      (test_t){
+        .pattern = "a^b",
+        .text = "ab",
+        .expected = false
+      },
+      (test_t){
+        .pattern = "a$|b",
+        .text = "b",
+        .expected = true
+      },
+
+      (test_t){
+        .pattern = "a|ab",
+        .text = "ab",
+        .spans = "0..1"
+      },
+      (test_t){
+        .pattern = "ab|a",
+        .text = "ab",
+        .spans = "0..2"
+      },
+      (test_t){
+        .pattern = "a|ab",
+        .text = "ab",
+        .spans = "0..2",
+        .longest = true
+      },
+      (test_t){
+        .pattern = "a|ab|abc",
+        .text = "xabcab",
+        .spans = "1..4 4..6",
+        .longest = true
+      },
+      (test_t){
+        .pattern = "a+b",
+        .text = "xaaab ab",
+        .spans = "1..5 6..8"
+      },
+      (test_t){
+        .pattern = "b*",
+        .text = "abba",
+        .spans = "0..0 1..3 3..3 4..4"
+      },
+      (test_t){
+        .pattern = "xyz[0-9]+",
+        .text = "xy xyz12 xyxyz3",
+        .spans = "3..8 11..15"
+      },
+      (test_t){
+        .pattern = "^a|a$",
+        .text = "aaa",
+        .spans = "0..1 2..3"
+      },
+      (test_t){
+        .pattern = "[0-9]{2}",
+        .text = "12345",
+        .spans = "0..2 2..4"
+      },
     };
     size_t test_count = sizeof(tests)/sizeof(tests[0]);
 
@@ -392,19 +1892,213 @@ int main(int argc, char **argv) {
         return 1;
       }
 
-      bool actual = regex_match(&regex, test.text);
-      if (actual != test.expected) fsm_dump(regex.fsm);
+      regex_lazy_t lazy = {0};
+      if (!regex_lazy_compile(&lazy, test.pattern)) {
+        fprintf(stderr, "Failed to compile pattern %s for the lazy engine\n", test.pattern);
+        return 1;
+      }
+
+      regex_set_t set = {0};
+      if (!regex_set_compile(&set, &test.pattern, 1, false)) {
+        fprintf(stderr, "Failed to compile pattern %s as a set\n", test.pattern);
+        return 1;
+      }
+
+      bool actual;
+      char found[256] = {0};
+      if (test.spans) {
+        regex_span_t spans[16];
+        lazy.semantics = test.longest ? REGEX_LEFTMOST_LONGEST : REGEX_LEFTMOST_FIRST;
+        size_t count = regex_find_all(&lazy, test.text, strlen(test.text), spans, 16);
+        for (size_t j = 0, at = 0; j < count && at < sizeof(found); ++j) {
+          at += snprintf(found + at, sizeof(found) - at, "%s%zu..%zu", j > 0 ? " " : "", spans[j].start, spans[j].end);
+        }
+        actual = strcmp(found, test.spans) == 0;
+        test.expected = true;
+      } else {
+        actual = regex_match(&regex, test.text);
+        if (actual != test.expected) fsm_dump(regex.fsm);
+        else actual = regex_lazy_match(&lazy, test.text);
+        if (actual == test.expected) {
+          // The same text again, one byte per chunk
+          regex_stream_t stream = regex_stream(&set);
+          for (const char *it = test.text; *it; ++it) (void)regex_stream_feed(&stream, it, 1, NULL, NULL);
+          actual = regex_stream_finish(&stream, NULL, NULL) > 0;
+        }
+      }
       printf("(%zu/%zu): ", i+1, test_count);
       if (actual == test.expected) printf("Success!\n");
       else {
         printf("Failed!\n");
-        printf("Expected %d but got %d\n", test.expected, actual);
+        if (test.spans) printf("Expected %s in \"%s\" at %s but got %s\n", test.pattern, test.text, test.spans, found);
+        else printf("Expected %d but got %d\n", test.expected, actual);
+        return 1;
+      }
+
+      regex_free(regex);
+      regex_lazy_free(lazy);
+      regex_set_free(set);
+    }
+
+    // One unanchored set over overlapping patterns, spilling past the first
+    // word of the bitset. Every other pattern is a filler that never matches.
+    const char *set_patterns[70];
+    for (size_t i = 0; i < 70; ++i) set_patterns[i] = "zz";
+    set_patterns[0] = "abc";
+    set_patterns[1] = "bc";
+    set_patterns[2] = "b+";
+    set_patterns[3] = "c$";
+    set_patterns[4] = "^a";
+    set_patterns[64] = "[0-9]{2}";
+    set_patterns[69] = "a|b";
+    typedef struct {
+      const char *text;
+      const char *expected; // Matching pattern indices, ascending
+    } set_test_t;
+    set_test_t set_tests[] = {
+      { .text = "abc", .expected = "0 1 2 3 4 69" },
+      { .text = "xbcx", .expected = "1 2 69" },
+      { .text = "ca", .expected = "69" },
+      { .text = "ac", .expected = "3 4 69" },
+      { .text = "a", .expected = "4 69" },
+      { .text = "x12c", .expected = "3 64" },
+      { .text = "xyz", .expected = "" },
+      { .text = "", .expected = "" },
+    };
+    size_t set_test_count = sizeof(set_tests)/sizeof(set_tests[0]);
+    regex_set_t set = {0};
+    if (!regex_set_compile(&set, set_patterns, 70, true)) {
+      fprintf(stderr, "Failed to compile the set\n");
+      return 1;
+    }
+    uint64_t matched[2];
+    for (size_t i = 0; i < set_test_count; ++i) {
+      set_test_t test = set_tests[i];
+      size_t count = regex_set_match(&set, test.text, strlen(test.text), matched);
+      char found[256] = {0};
+      size_t bits = 0;
+      for (size_t p = 0, at = 0; p < set.pattern_count; ++p) {
+        if (!(matched[p/64] >> p%64 & 1)) continue;
+        at += snprintf(found + at, sizeof(found) - at, "%s%zu", bits++ > 0 ? " " : "", p);
+      }
+      printf("set (%zu/%zu): ", i+1, set_test_count);
+      if (count == bits && strcmp(found, test.expected) == 0) printf("Success!\n");
+      else {
+        printf("Failed!\n");
+        printf("Expected patterns %s in \"%s\" but got %s (count %zu)\n", test.expected, test.text, found, count);
+        return 1;
+      }
+    }
+    regex_set_free(set);
+
+    // The same kind of set streamed with matches cut across chunks. What
+    // ends at the last byte only comes out of regex_stream_finish.
+    const char *stream_patterns[] = { "abc", "bc", "c$", "b+" };
+    typedef struct {
+      const char *chunks[4];
+      const char *fed;      // Reported by regex_stream_feed, as pattern@end
+      const char *finished; // Reported by regex_stream_finish
+    } stream_test_t;
+    stream_test_t stream_tests[] = {
+      { .chunks = { "xa", "bcb", "bc" }, .fed = "3@3 0@4 1@4 3@5 3@6", .finished = "1@7 2@7" },
+      { .chunks = { "a", "b", "c" }, .fed = "3@2", .finished = "0@3 1@3 2@3" },
+      { .chunks = { "abc", "", "x" }, .fed = "3@2 0@3 1@3", .finished = "" },
+      { .chunks = { "" }, .fed = "", .finished = "" },
+    };
+    size_t stream_test_count = sizeof(stream_tests)/sizeof(stream_tests[0]);
+    if (!regex_set_compile(&set, stream_patterns, 4, true)) {
+      fprintf(stderr, "Failed to compile the stream set\n");
+      return 1;
+    }
+    regex_stream_t stream = regex_stream(&set);
+    for (size_t i = 0; i < stream_test_count; ++i) {
+      stream_test_t test = stream_tests[i];
+      char fed[256] = {0}, finished[256] = {0};
+      size_t fed_count = 0;
+      for (size_t j = 0; j < 4 && test.chunks[j]; ++j) {
+        fed_count += regex_stream_feed(&stream, test.chunks[j], strlen(test.chunks[j]), regex_record_match, fed);
+      }
+      size_t finished_count = regex_stream_finish(&stream, regex_record_match, finished);
+      size_t expected_fed = *test.fed ? 1 : 0, expected_finished = *test.finished ? 1 : 0;
+      for (const char *it = test.fed; *it; ++it) expected_fed += *it == ' ';
+      for (const char *it = test.finished; *it; ++it) expected_finished += *it == ' ';
+      printf("stream (%zu/%zu): ", i+1, stream_test_count);
+      if (strcmp(fed, test.fed) == 0 && strcmp(finished, test.finished) == 0
+          && fed_count == expected_fed && finished_count == expected_finished) printf("Success!\n");
+      else {
+        printf("Failed!\n");
+        printf("Expected %s then %s but got %s then %s\n", test.fed, test.finished, fed, finished);
+        return 1;
+      }
+    }
+    regex_set_free(set);
+
+    // The twelfth byte from the end being an a takes 4096 DFA states, more
+    // than a lazy cache holds, so long random texts keep flushing it halfway
+    // through a match. The answer is easy to check without any engine.
+    regex_lazy_t flushed = {0};
+    if (!regex_lazy_compile(&flushed, "(a|b)*a(a|b){11}")) {
+      fprintf(stderr, "Failed to compile the flush pattern\n");
+      return 1;
+    }
+    static char flush_text[4097];
+    uint64_t seed = 88172645463325252ULL;
+    size_t flush_test_count = 32;
+    for (size_t i = 0; i < flush_test_count; ++i) {
+      size_t len = 12 + i*127;
+      for (size_t j = 0; j < len; ++j) {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        flush_text[j] = "ab"[seed >> 63];
+      }
+      flush_text[len] = '\0';
+      bool expected = flush_text[len - 12] == 'a';
+      bool actual = regex_lazy_match(&flushed, flush_text);
+      printf("flush (%zu/%zu): ", i+1, flush_test_count);
+      if (actual == expected) printf("Success!\n");
+      else {
+        printf("Failed!\n");
+        printf("Expected %d but got %d for %zu bytes after %zu flushes\n", expected, actual, len, flushed.cache->flushes);
         return 1;
       }
+    }
+    printf("flush: ");
+    if (flushed.cache->flushes > 0) printf("Success!\n");
+    else {
+      printf("Failed!\n");
+      printf("The cache never filled up\n");
+      return 1;
+    }
+    regex_lazy_free(flushed);
 
+    // Patterns every engine has to turn down
+    const char *rejected[] = {
+      "a{1001}",
+      "((a{1000}){1000}){1000}",
+      "(a{1000}){1000}",
+      "(a|b",
+    };
+    size_t rejected_count = sizeof(rejected)/sizeof(rejected[0]);
+    for (size_t i = 0; i < rejected_count; ++i) {
+      regex_t regex = {0};
+      regex_init(&regex);
+      regex_lazy_t lazy = {0};
+      regex_set_t set = {0};
+      bool compiled = regex_compile(&regex, rejected[i]);
+      compiled = regex_lazy_compile(&lazy, rejected[i]) || compiled;
+      compiled = regex_set_compile(&set, &rejected[i], 1, true) || compiled;
+      printf("rejected (%zu/%zu): ", i+1, rejected_count);
+      if (!compiled) printf("Success!\n");
+      else {
+        printf("Failed!\n");
+        printf("Pattern %s compiled\n", rejected[i]);
+        return 1;
+      }
       regex_free(regex);
     }
   }
 
   return 0;
-}
\ No newline at end of file
+}
+#endif // REGEX_NO_MAIN
@@ -0,0 +1,906 @@
+// Self-test for the ways of stepping a table. Every one of them has to end
+// where the scalar fsm_run_bytes ends on the same input.
+// Small chunks so short inputs already get split across threads
+#define FSM_PARALLEL_MIN_CHUNK 512
+#define FSM_IMPLEMENTATION
+#include "fsm.h"
+
+#include <stdlib.h>
+
+uint64_t tables_random(uint64_t *seed) {
+  *seed ^= *seed << 13;
+  *seed ^= *seed >> 7;
+  *seed ^= *seed << 17;
+  return *seed;
+}
+
+// A mutable table of `states` states over `events` events. With `exits`
+// some transitions leave the table, state `states-1` is dead when `dead`.
+fsm_t tables_build(size_t states, size_t events, bool exits, bool dead, uint64_t *seed) {
+  fsm_t fsm = {0};
+  fsm_init(&fsm, events);
+  for (size_t s = 0; s < states; ++s) (void)fsm_push_empty(&fsm);
+  for (size_t s = 0; s < states; ++s) {
+    for (size_t e = 0; e < events; ++e) {
+      uint64_t r = tables_random(seed);
+      fsm_state_t t = (fsm_state_t)(r % states);
+      if (exits && r % 97 == 0) t = (fsm_state_t)(states + r/97 % 3);
+      fsm_set(&fsm, s, e, t);
+    }
+    fsm_set_accepting(&fsm, s, tables_random(seed) % 3 == 0);
+  }
+  if (dead) fsm_set_dead(&fsm, (fsm_state_t)(states - 1));
+  return fsm;
+}
+
+void tables_input(uint8_t *input, size_t n, size_t events, uint64_t *seed) {
+  for (size_t i = 0; i < n; ++i) input[i] = (uint8_t)(tables_random(seed) % events);
+}
+
+fsm_run_t tables_reference(fsm_t fsm, fsm_state_t start, const uint8_t *input, size_t n) {
+  fsm.state = start;
+  return fsm__run_bytes_table(&fsm, input, n);
+}
+
+typedef struct {
+  size_t states;
+  size_t events;
+  bool exits;
+  bool dead;
+} tables_shape_t;
+
+const tables_shape_t tables_shapes[] = {
+  { 1, 2, false, false },
+  { 5, 3, true, false },
+  { 16, 256, false, true },
+  { 40, 7, true, true },
+  { 300, 256, true, false },
+  { 70000, 4, false, true },
+};
+
+// Every shape mutable, with compressed events and compacted, next to the
+// plain mutable table as the reference
+#define TABLES_VARIANTS 3
+#define TABLES_COUNT (sizeof(tables_shapes)/sizeof(tables_shapes[0]) * TABLES_VARIANTS)
+
+void tables_pair(size_t i, fsm_t *fsm, fsm_t *reference) {
+  const tables_shape_t *shape = &tables_shapes[i / TABLES_VARIANTS];
+  uint64_t seed = i / TABLES_VARIANTS + 1;
+  *reference = tables_build(shape->states, shape->events, shape->exits, shape->dead, &seed);
+  seed = i / TABLES_VARIANTS + 1;
+  *fsm = tables_build(shape->states, shape->events, shape->exits, shape->dead, &seed);
+  if (i % TABLES_VARIANTS >= 1) (void)fsm_compress_events(fsm);
+  if (i % TABLES_VARIANTS >= 2) (void)fsm_compact(fsm);
+}
+
+bool tables_multi(void) {
+  uint64_t seed = 7;
+  bool ok = true;
+  for (size_t t = 0; t < TABLES_COUNT; ++t) {
+    fsm_t fsm, reference;
+    tables_pair(t, &fsm, &reference);
+    uint8_t input[11][300];
+    const uint8_t *inputs[11];
+    size_t lens[11];
+    fsm_state_t states[11];
+    for (size_t i = 0; i < 11; ++i) {
+      lens[i] = tables_random(&seed) % 300;
+      tables_input(input[i], lens[i], fsm.event_count, &seed);
+      inputs[i] = input[i];
+    }
+    fsm.state = (fsm_state_t)(tables_random(&seed) % fsm.count);
+    fsm_run_multi(fsm, inputs, lens, states, 11);
+    for (size_t i = 0; i < 11; ++i) {
+      ok = ok && states[i] == tables_reference(reference, fsm.state, input[i], lens[i]).state;
+    }
+    fsm_free(fsm);
+    fsm_free(reference);
+  }
+  return ok;
+}
+
+// Mapping a chunk walks every start state, so the largest shape is skipped.
+// Where the run stops has to match too, not just the state.
+bool tables_parallel(void) {
+  uint64_t seed = 8;
+  bool ok = true;
+  static uint8_t input[8*FSM_PARALLEL_MIN_CHUNK + 100];
+  for (size_t t = 0; t < TABLES_COUNT; ++t) {
+    fsm_t fsm, reference;
+    tables_pair(t, &fsm, &reference);
+    for (size_t threads = 1; fsm.count <= 300 && threads <= 8; ++threads) {
+      size_t n = tables_random(&seed) % sizeof(input);
+      tables_input(input, n, fsm.event_count, &seed);
+      fsm.state = (fsm_state_t)(tables_random(&seed) % fsm.count);
+      fsm_run_t run = fsm_run_parallel(fsm, input, n, threads);
+      fsm_run_t expected = tables_reference(reference, fsm.state, input, n);
+      ok = ok && run.state == expected.state && run.consumed == expected.consumed;
+    }
+    fsm_free(fsm);
+    fsm_free(reference);
+  }
+
+  // Random tables mostly stop in the first chunk. Here only event 3 stops
+  // the run, leaving the table from state 0 and dying from state 1, and it
+  // is put around every chunk boundary.
+  fsm_t fsm = {0};
+  fsm_init(&fsm, 4);
+  for (fsm_state_t s = 0; s < 3; ++s) (void)fsm_push_empty(&fsm);
+  for (fsm_state_t s = 0; s < 2; ++s) {
+    for (fsm_event_t e = 0; e < 3; ++e) fsm_set(&fsm, s, e, (s + e) % 2);
+  }
+  fsm_set(&fsm, 0, 3, 3);
+  fsm_set(&fsm, 1, 3, 2);
+  for (fsm_event_t e = 0; e < 4; ++e) fsm_set(&fsm, 2, e, 2);
+  fsm_set_dead(&fsm, 2);
+  size_t n = 8*FSM_PARALLEL_MIN_CHUNK;
+  tables_input(input, n, 3, &seed);
+  for (size_t at = 1; ok && at < n; at += FSM_PARALLEL_MIN_CHUNK/2) {
+    for (size_t shift = 0; ok && shift < 3; ++shift) {
+      size_t stop = at + shift - 1;
+      input[stop] = 3;
+      for (size_t threads = 2; ok && threads <= 8; ++threads) {
+        fsm.state = 0;
+        fsm_run_t run = fsm_run_parallel(fsm, input, n, threads);
+        fsm_run_t expected = tables_reference(fsm, 0, input, n);
+        ok = run.state == expected.state && run.consumed == expected.consumed && run.consumed == stop + 1;
+      }
+      input[stop] = 0;
+    }
+  }
+  fsm_free(fsm);
+  return ok;
+}
+
+// Small frozen tables carry shuffle rows where the CPU has pshufb/vpermb.
+// fsm_run_bytes walks them and has to stop exactly where the scalar loop
+// over the same table does, exits and dead state included.
+bool tables_shuffle(void) {
+  uint64_t seed = 9;
+  bool ok = true;
+  size_t shuffled = 0;
+  uint8_t input[1000];
+  for (size_t t = 0; t < TABLES_COUNT; ++t) {
+    fsm_t fsm, reference;
+    tables_pair(t, &fsm, &reference);
+    shuffled += fsm.shuffle != NULL;
+#ifdef FSM__X86_SIMD
+    // Rows this CPU cannot shuffle with are not worth their memory
+    ok = ok && (fsm.shuffle_width != 16 || (fsm__simd_support() & 1))
+            && (fsm.shuffle_width != 64 || (fsm__simd_support() & 2));
+#endif
+    for (fsm_state_t start = 0; fsm.shuffle && start < fsm.count; ++start) {
+      size_t n = tables_random(&seed) % sizeof(input);
+      tables_input(input, n, fsm.event_count, &seed);
+      fsm_run_t expected = tables_reference(fsm, start, input, n);
+      fsm.state = start;
+      fsm_run_t run = fsm_run_bytes(&fsm, input, n);
+      ok = ok && run.state == expected.state && run.consumed == expected.consumed && fsm.state == run.state;
+    }
+    fsm_free(fsm);
+    fsm_free(reference);
+  }
+#ifdef FSM__X86_SIMD
+  ok = ok && (shuffled > 0 || !(fsm__simd_support() & 1));
+#endif
+  return ok;
+}
+
+// Compiles the output of fsm_emit_c with a driver that runs the input from
+// every start state and also steps on an event past the alphabet, then
+// compares what it prints with the table. Uses $CC, or cc.
+#define TABLES_EMIT_PATH "./build/tables_emit"
+
+bool tables_emit_one(fsm_t fsm, fsm_emit_t mode, const uint8_t *input, size_t n) {
+  FILE *out = fopen(TABLES_EMIT_PATH ".c", "w");
+  if (!out) return false;
+  if (!fsm_emit_c(fsm, out, "t", mode)) {
+    fclose(out);
+    return false;
+  }
+  fprintf(out, "\n#include <stdio.h>\n\n");
+  fprintf(out, "int main(void) {\n");
+  fprintf(out, "  static uint8_t input[%zu];\n", n + 1);
+  fprintf(out, "  size_t n = fread(input, 1, sizeof(input), stdin);\n");
+  fprintf(out, "  for (uint32_t start = 0; start < %zu; ++start) {\n", fsm.count);
+  fprintf(out, "    uint32_t state = start;\n");
+  fprintf(out, "    size_t used = t_run(&state, input, n);\n");
+  fprintf(out, "    printf(\"%%u %%zu %%d %%u\\n\", state, used, t_accepting(state), t_step(start, %zu));\n", fsm.event_count);
+  fprintf(out, "  }\n  return 0;\n}\n");
+  fclose(out);
+
+  out = fopen(TABLES_EMIT_PATH ".in", "wb");
+  if (!out) return false;
+  fwrite(input, 1, n, out);
+  fclose(out);
+
+  const char *cc = getenv("CC") ? getenv("CC") : "cc";
+  char command[512];
+  snprintf(command, sizeof(command), "%s -std=c99 -Wall -Wextra -Werror -o " TABLES_EMIT_PATH " " TABLES_EMIT_PATH ".c", cc);
+  if (system(command) != 0) return false;
+  if (system(TABLES_EMIT_PATH " < " TABLES_EMIT_PATH ".in > " TABLES_EMIT_PATH ".out") != 0) return false;
+
+  FILE *in = fopen(TABLES_EMIT_PATH ".out", "r");
+  if (!in) return false;
+  bool ok = true;
+  for (fsm_state_t start = 0; ok && start < fsm.count; ++start) {
+    unsigned state, step;
+    size_t used;
+    int accepting;
+    fsm_run_t expected = tables_reference(fsm, start, input, n);
+    fsm_state_t stray = fsm.dead != FSM_NO_STATE ? fsm.dead : start;
+    ok = fscanf(in, "%u %zu %d %u", &state, &used, &accepting, &step) == 4
+      && state == expected.state && used == expected.consumed
+      && (accepting != 0) == fsm_is_accepting(fsm, expected.state) && step == stray;
+  }
+  fclose(in);
+  return ok;
+}
+
+// Names that would not paste into identifiers are refused before anything
+// is written
+bool tables_emit(void) {
+  uint64_t seed = 10;
+  bool ok = true;
+  uint8_t input[500];
+  const char *bad_names[] = { "", "1x", "a-b", "t t", "t;" };
+  for (size_t i = 0; ok && i < sizeof(bad_names)/sizeof(bad_names[0]); ++i) {
+    fsm_t fsm, reference;
+    tables_pair(0, &fsm, &reference);
+    FILE *out = tmpfile();
+    ok = out && !fsm_emit_c(fsm, out, bad_names[i], FSM_EMIT_TABLE)
+      && !fsm_emit_c(fsm, out, bad_names[i], FSM_EMIT_SWITCH) && ftell(out) == 0;
+    if (out) fclose(out);
+    fsm_free(fsm);
+    fsm_free(reference);
+  }
+  for (size_t t = 0; ok && t < TABLES_COUNT; ++t) {
+    fsm_t fsm, reference;
+    tables_pair(t, &fsm, &reference);
+    // Mutable and compacted tables, small enough to compile quickly
+    if (t % TABLES_VARIANTS != 1 && fsm.count <= 64) {
+      size_t n = tables_random(&seed) % sizeof(input);
+      tables_input(input, n, fsm.event_count, &seed);
+      fsm.state = 0;
+      ok = tables_emit_one(fsm, FSM_EMIT_TABLE, input, n) && tables_emit_one(fsm, FSM_EMIT_SWITCH, input, n);
+    }
+    fsm_free(fsm);
+    fsm_free(reference);
+  }
+  return ok;
+}
+
+#define TABLES_MAP_PATH "./build/tables_map.fsm"
+
+// Overwrites one byte of the block in TABLES_MAP_PATH, with the checksum
+// recomputed when `rehash` so only the other checks of fsm_map can object
+bool tables_tamper(size_t offset, uint8_t value, bool rehash) {
+  FILE *in = fopen(TABLES_MAP_PATH, "rb");
+  if (!in) return false;
+  static uint8_t file[1 << 21];
+  size_t size = fread(file, 1, sizeof(file), in);
+  fclose(in);
+  if (size <= FSM_FILE_HEADER_SIZE + offset) return false;
+  file[FSM_FILE_HEADER_SIZE + offset] = value;
+  if (rehash) {
+    fsm__file_header_t header;
+    memcpy(&header, file, sizeof(header));
+    header.checksum = fsm__fnv1a(14695981039346656037ULL, file + FSM_FILE_HEADER_SIZE, size - FSM_FILE_HEADER_SIZE);
+    memcpy(file, &header, sizeof(header));
+  }
+  FILE *out = fopen(TABLES_MAP_PATH, "wb");
+  if (!out) return false;
+  bool ok = fwrite(file, 1, size, out) == size;
+  return fclose(out) == 0 && ok;
+}
+
+// fsm_save followed by fsm_map has to give back the same table, and a class
+// entry past class_count is refused even under a valid checksum. A full
+// 256-class map has no such entry to write.
+bool tables_map(void) {
+  uint64_t seed = 11;
+  bool ok = true;
+  uint8_t input[1000];
+  for (size_t t = 0; ok && t < TABLES_COUNT; ++t) {
+    fsm_t fsm, reference;
+    tables_pair(t, &fsm, &reference);
+    fsm.state = (fsm_state_t)(tables_random(&seed) % fsm.count);
+    fsm_t mapped = {0};
+    ok = fsm_save(fsm, TABLES_MAP_PATH) && fsm_map(&mapped, TABLES_MAP_PATH);
+    ok = ok && mapped.frozen && mapped.state == fsm.state && mapped.count == fsm.count
+            && mapped.event_count == fsm.event_count && mapped.class_count == fsm.class_count
+            && mapped.cell_size == fsm.cell_size && mapped.dead == fsm.dead;
+    for (fsm_state_t s = 0; ok && s < fsm.count; ++s) {
+      ok = fsm_is_accepting(mapped, s) == fsm_is_accepting(reference, s);
+      for (fsm_event_t e = 0; ok && e < fsm.event_count; ++e) {
+        ok = fsm_get(mapped, s, e) == fsm_get(reference, s, e);
+      }
+    }
+    for (size_t i = 0; ok && i < 8; ++i) {
+      size_t n = tables_random(&seed) % sizeof(input);
+      tables_input(input, n, fsm.event_count, &seed);
+      fsm_run_t expected = tables_reference(reference, fsm.state, input, n);
+      mapped.state = fsm.state;
+      fsm_run_t run = fsm_run_bytes(&mapped, input, n);
+      ok = run.state == expected.state && run.consumed == expected.consumed;
+    }
+    if (mapped.items) fsm_free(mapped);
+
+    if (ok && fsm.classes && fsm.class_count < FSM_MAX_CLASSES) {
+      fsm__layout_t layout = fsm__frozen_layout(fsm.count, fsm.class_count, fsm.cell_size,
+                                                true, fsm.shuffle ? fsm.shuffle_width : 0);
+      fsm_t untouched = { .count = 12345 };
+      ok = fsm_save(fsm, TABLES_MAP_PATH) && tables_tamper(layout.classes, (uint8_t)fsm.class_count, true)
+        && !fsm_map(&untouched, TABLES_MAP_PATH) && untouched.count == 12345 && untouched.items == NULL;
+      ok = ok && fsm_save(fsm, TABLES_MAP_PATH) && tables_tamper(0, 0xff, false)
+        && !fsm_map(&untouched, TABLES_MAP_PATH) && untouched.count == 12345;
+    }
+    fsm_free(fsm);
+    fsm_free(reference);
+  }
+  return ok;
+}
+
+// Hands out `budget` blocks and then refuses, counting what is still live.
+// Each block remembers its size so a free with the wrong one is caught.
+typedef struct {
+  size_t budget;
+  size_t refused;
+  size_t live;
+  bool mismatched;
+} tables_limit_t;
+
+void *tables_limit_alloc(void *user, size_t size) {
+  tables_limit_t *limit = user;
+  if (limit->budget == 0) {
+    limit->refused++;
+    return NULL;
+  }
+  uint8_t *raw = malloc(size + FSM_ALIGNMENT + 2*sizeof(size_t));
+  if (!raw) return NULL;
+  limit->budget--;
+  limit->live++;
+  uintptr_t aligned = ((uintptr_t)(raw + 2*sizeof(size_t)) + FSM_ALIGNMENT-1) & ~(uintptr_t)(FSM_ALIGNMENT-1);
+  ((size_t*)aligned)[-1] = (size_t)(aligned - (uintptr_t)raw);
+  ((size_t*)aligned)[-2] = size;
+  return (void*)aligned;
+}
+
+void tables_limit_free(void *user, void *ptr, size_t size) {
+  tables_limit_t *limit = user;
+  limit->mismatched = limit->mismatched || ((size_t*)ptr)[-2] != size;
+  limit->live--;
+  free((uint8_t*)ptr - ((size_t*)ptr)[-1]);
+}
+
+// Whether the runs from `start` on a fixed set of inputs end in accepting
+// states, as a bitmask. Survives renumbering, so it compares any two forms
+// of the same table.
+uint64_t tables_verdicts(fsm_t fsm, fsm_state_t start) {
+  uint64_t seed = 12, verdicts = 0;
+  uint8_t input[64];
+  for (size_t i = 0; i < 64; ++i) {
+    size_t n = tables_random(&seed) % sizeof(input);
+    tables_input(input, n, fsm.event_count, &seed);
+    fsm.state = start;
+    fsm_run_t run = fsm_run_bytes(&fsm, input, n);
+    if (fsm_is_accepting(fsm, run.state)) verdicts |= 1ULL << i;
+  }
+  return verdicts;
+}
+
+// Lets the allocator run dry after 0, 1, 2, ... blocks. Every operation
+// either succeeds or says it failed and leaves the table as it was, the
+// parallel run falls back to one thread, and once everything is freed no
+// block is left behind.
+bool tables_oom(void) {
+  bool ok = true, completed = false;
+  for (size_t budget = 0; ok && !completed && budget < 64; ++budget) {
+    tables_limit_t limit = { .budget = budget };
+    fsm_allocator_t allocator = { tables_limit_alloc, tables_limit_free, &limit };
+    fsm_t fsm = {0};
+    fsm_init_with(&fsm, 4, &allocator);
+    uint64_t seed = 13;
+    size_t refused = 0;
+    bool built = true;
+    for (size_t s = 0; built && s < 40; ++s) {
+      built = fsm_push_empty(&fsm) != FSM_NO_STATE;
+      ok = ok && built == (limit.refused == refused) && fsm.count == s + built;
+      refused = limit.refused;
+    }
+    for (fsm_state_t s = 0; built && s < fsm.count; ++s) {
+      for (fsm_event_t e = 0; e < fsm.event_count; ++e) fsm_set(&fsm, s, e, (fsm_state_t)(tables_random(&seed) % fsm.count));
+      fsm_set_accepting(&fsm, s, tables_random(&seed) % 3 == 0);
+    }
+
+    if (built) {
+      uint64_t verdicts = tables_verdicts(fsm, 0);
+
+      // Without scratch the parallel run stays on the calling thread
+      static uint8_t input[4*FSM_PARALLEL_MIN_CHUNK];
+      uint64_t input_seed = 17;
+      tables_input(input, sizeof(input), fsm.event_count, &input_seed);
+      fsm_t sequential = fsm;
+      fsm_run_t run = fsm_run_parallel(fsm, input, sizeof(input), 4);
+      fsm_run_t expected = fsm_run_bytes(&sequential, input, sizeof(input));
+      ok = ok && run.state == expected.state && run.consumed == expected.consumed;
+      refused = limit.refused;
+
+      FILE *out = tmpfile();
+      ok = ok && out && fsm_emit_c(fsm, out, "t", FSM_EMIT_SWITCH) == (limit.refused == refused)
+              && (limit.refused == refused || ftell(out) == 0);
+      if (out) fclose(out);
+      refused = limit.refused;
+
+      fsm_state_t copy = fsm_duplicate(&fsm, 3);
+      ok = ok && (copy != FSM_NO_STATE) == (limit.refused == refused) && fsm.count == 40 + (copy != FSM_NO_STATE);
+      refused = limit.refused;
+
+      fsm_state_t remap[41];
+      fsm_t min = { .count = 12345 };
+      fsm.state = 0;
+      bool minimized = fsm_minimize(fsm, &min, remap);
+      ok = ok && minimized == (limit.refused == refused) && (minimized || min.count == 12345);
+      ok = ok && (!minimized || (min.state == remap[0] && tables_verdicts(min, min.state) == verdicts));
+      if (minimized) fsm_free(min);
+      refused = limit.refused;
+
+      ok = ok && fsm_compress_events(&fsm) == (limit.refused == refused) && tables_verdicts(fsm, 0) == verdicts;
+      refused = limit.refused;
+      ok = ok && fsm_compact(&fsm) == (limit.refused == refused) && tables_verdicts(fsm, 0) == verdicts;
+      refused = limit.refused;
+      fsm.state = 0;
+      bool reordered = fsm_reorder(&fsm, NULL, remap);
+      ok = ok && reordered == (limit.refused == refused);
+      ok = ok && tables_verdicts(fsm, reordered ? remap[0] : 0) == verdicts;
+      completed = limit.refused == 0;
+    }
+    if (fsm.items) fsm_free(fsm);
+    ok = ok && limit.live == 0 && !limit.mismatched;
+  }
+
+  // An arena that fills up mid-build keeps the table it had
+  static uint8_t buffer[4096];
+  fsm_arena_t arena;
+  fsm_arena_init(&arena, buffer, sizeof(buffer));
+  fsm_allocator_t allocator = fsm_arena_allocator(&arena);
+  fsm_t fsm = {0};
+  fsm_init_with(&fsm, 4, &allocator);
+  while (fsm_push_empty(&fsm) != FSM_NO_STATE) {
+    fsm_set(&fsm, fsm.count - 1, 1, fsm.count - 1);
+  }
+  ok = ok && fsm.count > 0 && arena.used <= arena.size;
+  for (fsm_state_t s = 0; ok && s < fsm.count; ++s) ok = fsm_get(fsm, s, 1) == s && fsm_get(fsm, s, 0) == 0;
+  fsm_arena_reset(&arena);
+  return ok && completed;
+}
+
+// fsm_reorder only renames states: remapped through `remap` every cell,
+// accept bit and run has to match the original table. With visits the
+// rows are sorted hottest first, the dead one last.
+bool tables_reorder(void) {
+  uint64_t seed = 15;
+  bool ok = true;
+  uint8_t input[1000];
+  for (size_t t = 0; ok && t < 2*TABLES_COUNT; ++t) {
+    fsm_t fsm, reference;
+    tables_pair(t / 2, &fsm, &reference);
+    fsm_state_t *remap = malloc(sizeof(*remap) * fsm.count);
+    uint64_t *visits = malloc(sizeof(*visits) * fsm.count);
+    fsm_state_t *order = malloc(sizeof(*order) * fsm.count);
+    assert(remap && visits && order && "Buy more RAM lol");
+    for (size_t s = 0; s < fsm.count; ++s) visits[s] = tables_random(&seed) % 5;
+    bool hot = t % 2 == 1;
+    fsm_state_t start = (fsm_state_t)(tables_random(&seed) % fsm.count);
+    fsm.state = start;
+    ok = fsm_reorder(&fsm, hot ? visits : NULL, remap) && fsm.state == remap[start];
+    ok = ok && fsm.dead == (reference.dead == FSM_NO_STATE ? FSM_NO_STATE : remap[reference.dead]);
+    ok = ok && (fsm.dead == FSM_NO_STATE || fsm.dead == fsm.count - 1);
+    for (size_t s = 0; s < fsm.count; ++s) order[s] = FSM_NO_STATE;
+    for (fsm_state_t s = 0; ok && s < fsm.count; ++s) {
+      ok = remap[s] < fsm.count && order[remap[s]] == FSM_NO_STATE;
+      order[remap[s]] = s;
+    }
+    for (size_t s = 1; ok && hot && s < fsm.count; ++s) {
+      ok = order[s] == reference.dead || visits[order[s-1]] >= visits[order[s]];
+    }
+    for (fsm_state_t s = 0; ok && s < fsm.count; ++s) {
+      ok = fsm_is_accepting(fsm, remap[s]) == fsm_is_accepting(reference, s);
+      for (fsm_event_t e = 0; ok && e < fsm.event_count; ++e) {
+        fsm_state_t target = fsm_get(reference, s, e);
+        ok = fsm_get(fsm, remap[s], e) == (target < fsm.count ? remap[target] : target);
+      }
+    }
+    for (size_t i = 0; ok && i < 8; ++i) {
+      size_t n = tables_random(&seed) % sizeof(input);
+      tables_input(input, n, fsm.event_count, &seed);
+      fsm_run_t expected = tables_reference(reference, start, input, n);
+      fsm.state = remap[start];
+      fsm_run_t run = fsm_run_bytes(&fsm, input, n);
+      ok = run.consumed == expected.consumed
+        && run.state == (expected.state < fsm.count ? remap[expected.state] : expected.state);
+    }
+    free(remap);
+    free(visits);
+    free(order);
+    fsm_free(fsm);
+    fsm_free(reference);
+  }
+  return ok;
+}
+
+typedef struct {
+  const fsm_t *fsm;
+  const uint8_t *input;
+  size_t n;
+  fsm_state_t start;
+  fsm_run_t expected;
+  bool ok;
+} tables_reader_t;
+
+void *tables_cursor_reader(void *arg) {
+  tables_reader_t *reader = arg;
+  fsm_cursor_t cursor = fsm_cursor(reader->fsm);
+  reader->ok = true;
+  for (size_t i = 0; reader->ok && i < 200; ++i) {
+    cursor.state = reader->start;
+    fsm_run_t run = fsm_cursor_run_bytes(&cursor, reader->input, reader->n);
+    reader->ok = run.state == reader->expected.state && run.consumed == reader->expected.consumed
+              && cursor.state == run.state;
+  }
+  return NULL;
+}
+
+// Cursors step a table they only read: every one of their runners has to
+// agree with the table's own, and threads sharing one table through cursors
+// must neither disturb each other nor write to it
+bool tables_cursor(void) {
+  uint64_t seed = 16;
+  bool ok = true;
+  uint8_t input[1000];
+  fsm_event_t events[1000];
+  for (size_t t = 0; ok && t < TABLES_COUNT; ++t) {
+    fsm_t fsm, reference;
+    tables_pair(t, &fsm, &reference);
+    fsm.state = (fsm_state_t)(tables_random(&seed) % fsm.count);
+    fsm_t header = fsm;
+    uint64_t block = fsm__fnv1a(14695981039346656037ULL, fsm.items, fsm.block_size);
+    fsm_cursor_t cursor = fsm_cursor(&fsm);
+    ok = cursor.state == fsm.state && sizeof(cursor) % FSM_ALIGNMENT == 0;
+
+    reference.state = fsm.state;
+    for (size_t i = 0; ok && i < 100 && reference.state < fsm.count; ++i) {
+      fsm_event_t event = (fsm_event_t)(tables_random(&seed) % fsm.event_count);
+      ok = fsm_cursor_fire(&cursor, event) == fsm_fire_event(&reference, event);
+    }
+
+    for (size_t i = 0; ok && i < 8; ++i) {
+      size_t n = tables_random(&seed) % sizeof(input);
+      tables_input(input, n, fsm.event_count, &seed);
+      for (size_t j = 0; j < n; ++j) events[j] = input[j];
+      fsm_cursor_reset(&cursor);
+      fsm_state_t start = cursor.state;
+      fsm_run_t expected = tables_reference(reference, start, input, n);
+      fsm_run_t run = fsm_cursor_run_bytes(&cursor, input, n);
+      ok = run.state == expected.state && run.consumed == expected.consumed && cursor.state == run.state;
+
+      cursor.state = start;
+      run = fsm_cursor_run(&cursor, events, n);
+      ok = ok && run.state == expected.state && run.consumed == expected.consumed;
+
+      reference.state = start;
+      expected = fsm_scan_bytes(&reference, input, n);
+      cursor.state = start;
+      run = fsm_cursor_scan_bytes(&cursor, input, n);
+      ok = ok && run.state == expected.state && run.consumed == expected.consumed;
+      cursor.state = start;
+      run = fsm_cursor_scan(&cursor, events, n);
+      ok = ok && run.state == expected.state && run.consumed == expected.consumed;
+    }
+
+#ifndef FSM_NO_THREADS
+    tables_reader_t readers[4];
+    pthread_t threads[4];
+    bool spawned[4];
+    size_t n = tables_random(&seed) % sizeof(input);
+    tables_input(input, n, fsm.event_count, &seed);
+    for (size_t i = 0; i < 4; ++i) {
+      fsm_state_t start = (fsm_state_t)(tables_random(&seed) % fsm.count);
+      readers[i] = (tables_reader_t){ &fsm, input, n, start, tables_reference(reference, start, input, n), false };
+      spawned[i] = pthread_create(&threads[i], NULL, tables_cursor_reader, &readers[i]) == 0;
+      if (!spawned[i]) tables_cursor_reader(&readers[i]);
+    }
+    for (size_t i = 0; i < 4; ++i) {
+      if (spawned[i]) pthread_join(threads[i], NULL);
+      ok = ok && readers[i].ok;
+    }
+#endif
+    ok = ok && memcmp(&header, &fsm, sizeof(fsm)) == 0
+            && fsm__fnv1a(14695981039346656037ULL, fsm.items, fsm.block_size) == block;
+    fsm_free(fsm);
+    fsm_free(reference);
+  }
+  return ok;
+}
+
+#if defined(__GNUC__) && !defined(FSM_NO_THREADS)
+#define TABLES_PUBLISHES 2000
+#define TABLES_READERS 4
+
+// Keeps every block it hands out. A freed block is poisoned instead of
+// released, so a reader still walking it fails validation rather than
+// reading someone else's memory, and a second free shows up in the count.
+typedef struct {
+  struct {
+    uint8_t *raw;
+    size_t size;
+    size_t frees;
+  } *blocks;
+  size_t count;
+  size_t capacity;
+  bool mismatched;
+} tables_ledger_t;
+
+void *tables_ledger_alloc(void *user, size_t size) {
+  tables_ledger_t *ledger = user;
+  if (ledger->count == ledger->capacity) return NULL;
+  uint8_t *raw = malloc(size + FSM_ALIGNMENT + sizeof(size_t));
+  if (!raw) return NULL;
+  uintptr_t aligned = ((uintptr_t)(raw + sizeof(size_t)) + FSM_ALIGNMENT-1) & ~(uintptr_t)(FSM_ALIGNMENT-1);
+  ((size_t*)aligned)[-1] = ledger->count;
+  ledger->blocks[ledger->count].raw = raw;
+  ledger->blocks[ledger->count].size = size;
+  ledger->blocks[ledger->count].frees = 0;
+  ledger->count++;
+  return (void*)aligned;
+}
+
+void tables_ledger_free(void *user, void *ptr, size_t size) {
+  tables_ledger_t *ledger = user;
+  size_t index = ((size_t*)ptr)[-1];
+  ledger->mismatched = ledger->mismatched || ledger->blocks[index].size != size;
+  ledger->blocks[index].frees++;
+  memset(ptr, 0xdd, size);
+}
+
+// Version v has 2 + v%30 states, each going to the next one on any event,
+// and all of them accepting
+fsm_t tables_version(size_t v, const fsm_allocator_t *allocator) {
+  fsm_t fsm = {0};
+  fsm_init_with(&fsm, 4, allocator);
+  size_t count = 2 + v%30;
+  for (size_t s = 0; s < count; ++s) {
+    fsm_state_t state = fsm_push_empty(&fsm);
+    assert(state != FSM_NO_STATE && "Buy more RAM lol");
+    for (fsm_event_t e = 0; e < fsm.event_count; ++e) fsm_set(&fsm, state, e, (fsm_state_t)((s + 1) % count));
+    fsm_set_accepting(&fsm, state, true);
+  }
+  bool compacted = fsm_compact(&fsm);
+  assert(compacted && "Buy more RAM lol");
+  (void)compacted;
+  return fsm;
+}
+
+// Registered readers have to outlive the threads, so they live here
+typedef struct {
+  fsm_shared_t *shared;
+  fsm_reader_t reader;
+  bool *stop;
+  size_t entered;
+  bool ok;
+} tables_shared_reader_t;
+
+void *tables_shared_reader(void *arg) {
+  tables_shared_reader_t *context = arg;
+  fsm_reader_t *reader = &context->reader;
+  fsm_shared_register(context->shared, reader);
+  uint8_t input[37] = {0};
+  context->ok = true;
+  while (context->ok && !__atomic_load_n(context->stop, __ATOMIC_ACQUIRE)) {
+    const fsm_t *fsm = fsm_shared_enter(context->shared, reader);
+    if (fsm) {
+      size_t count = fsm->count;
+      context->ok = fsm->frozen && count >= 2 && count < 32;
+      for (fsm_state_t s = 0; context->ok && s < count; ++s) {
+        context->ok = fsm_is_accepting(*fsm, s);
+        for (fsm_event_t e = 0; context->ok && e < fsm->event_count; ++e) {
+          context->ok = fsm_get(*fsm, s, e) == (s + 1) % count;
+        }
+      }
+      fsm_cursor_t cursor = fsm_cursor(fsm);
+      cursor.state = 0;
+      fsm_run_t run = fsm_cursor_run_bytes(&cursor, input, sizeof(input));
+      context->ok = context->ok && run.consumed == sizeof(input) && run.state == sizeof(input) % count;
+      ++context->entered;
+    }
+    fsm_shared_leave(reader);
+  }
+  return NULL;
+}
+
+// Readers enter and leave as fast as they can while one writer publishes
+// new versions. Nobody may see a freed table, retired ones have to be
+// freed while the readers are still going, unregistered readers must not
+// hold anything back, and after fsm_shared_free every block must have been
+// freed exactly once.
+bool tables_shared(void) {
+  tables_ledger_t ledger = { .capacity = 8*TABLES_PUBLISHES };
+  ledger.blocks = malloc(sizeof(*ledger.blocks) * ledger.capacity);
+  assert(ledger.blocks && "Buy more RAM lol");
+  fsm_allocator_t allocator = { tables_ledger_alloc, tables_ledger_free, &ledger };
+
+  fsm_shared_t shared;
+  fsm_shared_init(&shared);
+  bool stop = false;
+  tables_shared_reader_t contexts[TABLES_READERS];
+  pthread_t threads[TABLES_READERS];
+  bool spawned[TABLES_READERS];
+  for (size_t i = 0; i < TABLES_READERS; ++i) {
+    contexts[i] = (tables_shared_reader_t){ .shared = &shared, .stop = &stop, .ok = true };
+    spawned[i] = pthread_create(&threads[i], NULL, tables_shared_reader, &contexts[i]) == 0;
+  }
+
+  bool ok = true;
+  for (size_t v = 0; ok && v < TABLES_PUBLISHES; ++v) {
+    ok = fsm_shared_publish(&shared, tables_version(v, &allocator));
+  }
+  size_t freed = 0;
+  for (size_t i = 0; i < ledger.count; ++i) freed += ledger.blocks[i].frees > 0;
+
+  __atomic_store_n(&stop, true, __ATOMIC_RELEASE);
+  size_t entered = 0;
+  for (size_t i = 0; i < TABLES_READERS; ++i) {
+    if (spawned[i]) pthread_join(threads[i], NULL);
+    ok = ok && spawned[i] && contexts[i].ok;
+    entered += contexts[i].entered;
+  }
+  ok = ok && entered > 0 && fsm_shared_reclaim(&shared) == 0;
+
+  // A reader left inside pins what it saw, the thread readers behind it on
+  // the list are unregistered and poisoned meanwhile. Once it leaves and is
+  // unregistered too, the list is empty and nothing is left waiting.
+  fsm_reader_t pinned;
+  fsm_shared_register(&shared, &pinned);
+  ok = ok && fsm_shared_enter(&shared, &pinned) != NULL;
+  ok = ok && fsm_shared_publish(&shared, tables_version(0, &allocator)) && fsm_shared_reclaim(&shared) == 1;
+  for (size_t i = 0; i < TABLES_READERS; ++i) {
+    if (!spawned[i]) continue;
+    fsm_shared_unregister(&shared, &contexts[i].reader);
+    memset(&contexts[i].reader, 0xdd, sizeof(contexts[i].reader));
+  }
+  ok = ok && fsm_shared_reclaim(&shared) == 1;
+  fsm_shared_leave(&pinned);
+  fsm_shared_unregister(&shared, &pinned);
+  memset(&pinned, 0xdd, sizeof(pinned));
+  ok = ok && fsm_shared_reclaim(&shared) == 0 && shared.readers == NULL;
+  fsm_shared_free(&shared);
+
+  // Each version allocates one frozen block, the rest are mutable ones
+  // fsm_compact gave back. Some frozen ones had to go while readers ran.
+  ok = ok && freed > ledger.count - TABLES_PUBLISHES && !ledger.mismatched;
+  for (size_t i = 0; i < ledger.count; ++i) {
+    ok = ok && ledger.blocks[i].frees == 1;
+    free(ledger.blocks[i].raw);
+  }
+  free(ledger.blocks);
+  return ok;
+}
+#endif
+
+// Counts the states of `fsm` reachable from fsm.state
+size_t tables_reachable(fsm_t fsm) {
+  bool *seen = calloc(fsm.count + 1, sizeof(*seen));
+  fsm_state_t *queue = malloc(sizeof(*queue) * (fsm.count + 1));
+  assert(seen && queue && "Buy more RAM lol");
+  size_t queued = 0;
+  if (fsm.state < fsm.count) {
+    seen[fsm.state] = true;
+    queue[queued++] = fsm.state;
+  }
+  for (size_t i = 0; i < queued; ++i) {
+    for (fsm_event_t e = 0; e < fsm.event_count; ++e) {
+      fsm_state_t t = fsm_get(fsm, queue[i], e);
+      if (t < fsm.count && !seen[t]) {
+        seen[t] = true;
+        queue[queued++] = t;
+      }
+    }
+  }
+  free(seen);
+  free(queue);
+  return queued;
+}
+
+// fsm_minimize keeps only what fsm.state reaches and merges what cannot be
+// told apart: every state it keeps is reachable, a second pass finds
+// nothing left to merge, and runs end in the remapped state at the same
+// byte. Exits keep their distance past the table.
+bool tables_minimize(void) {
+  uint64_t seed = 18;
+  bool ok = true;
+  uint8_t input[1000];
+  for (size_t t = 0; ok && t < TABLES_COUNT; ++t) {
+    fsm_t fsm, reference;
+    tables_pair(t, &fsm, &reference);
+    fsm_state_t start = (fsm_state_t)(tables_random(&seed) % fsm.count);
+    fsm_state_t *remap = malloc(sizeof(*remap) * fsm.count);
+    assert(remap && "Buy more RAM lol");
+    fsm_t min = {0}, again = {0};
+    fsm.state = start;
+    ok = fsm_minimize(fsm, &min, remap) && min.state == remap[start];
+    ok = ok && tables_reachable(min) == min.count && tables_reachable(fsm) <= fsm.count;
+    ok = ok && fsm_minimize(min, &again, NULL) && again.count == min.count && again.state == min.state;
+    for (fsm_state_t s = 0; ok && s < fsm.count; ++s) {
+      ok = remap[s] == FSM_NO_STATE || (remap[s] < min.count && fsm_is_accepting(min, remap[s]) == fsm_is_accepting(reference, s));
+    }
+    ok = ok && (reference.dead == FSM_NO_STATE || remap[reference.dead] == FSM_NO_STATE || min.dead == remap[reference.dead]);
+    for (size_t i = 0; ok && i < 8; ++i) {
+      size_t n = tables_random(&seed) % sizeof(input);
+      tables_input(input, n, fsm.event_count, &seed);
+      fsm_run_t expected = tables_reference(reference, start, input, n);
+      min.state = remap[start];
+      fsm_run_t run = fsm_run_bytes(&min, input, n);
+      fsm_state_t state = expected.state < fsm.count ? remap[expected.state] : (fsm_state_t)(min.count + expected.state - fsm.count);
+      ok = run.state == state && run.consumed == expected.consumed;
+    }
+    if (again.items) fsm_free(again);
+    if (min.items) fsm_free(min);
+    free(remap);
+    fsm_free(fsm);
+    fsm_free(reference);
+  }
+
+  // Two copies of one cycle, only the first reachable: the copy goes and
+  // the cycle collapses to one state per residue that matters
+  fsm_t fsm = {0};
+  fsm_init(&fsm, 2);
+  for (fsm_state_t s = 0; s < 8; ++s) (void)fsm_push_empty(&fsm);
+  for (fsm_state_t s = 0; s < 8; ++s) {
+    fsm_set(&fsm, s, 0, s/4*4 + (s + 1) % 4);
+    fsm_set(&fsm, s, 1, s);
+    fsm_set_accepting(&fsm, s, s % 2 == 0);
+  }
+  fsm_state_t remap[8];
+  fsm_t min = {0};
+  fsm.state = 1;
+  ok = ok && fsm_minimize(fsm, &min, remap);
+  ok = ok && min.count == 2 && min.state == remap[1] && remap[5] == FSM_NO_STATE
+          && remap[0] == remap[2] && remap[1] == remap[3] && !fsm_is_accepting(min, min.state);
+  if (min.items) fsm_free(min);
+  fsm_free(fsm);
+  return ok;
+}
+
+#ifndef TABLES_NO_MAIN
+int main(void) {
+  typedef struct {
+    const char *name;
+    bool (*run)(void);
+  } test_t;
+  test_t tests[] = {
+    { "fsm_run_multi", tables_multi },
+    { "fsm_run_parallel", tables_parallel },
+    { "shuffle kernels", tables_shuffle },
+    { "fsm_emit_c", tables_emit },
+    { "fsm_save/fsm_map", tables_map },
+    { "failing allocator", tables_oom },
+    { "fsm_reorder", tables_reorder },
+    { "fsm_minimize", tables_minimize },
+    { "fsm_cursor_t", tables_cursor },
+#if defined(__GNUC__) && !defined(FSM_NO_THREADS)
+    { "fsm_shared_t", tables_shared },
+#endif
+  };
+  size_t test_count = sizeof(tests)/sizeof(tests[0]);
+
+  for (size_t i = 0; i < test_count; ++i) {
+    printf("(%zu/%zu) %s: ", i+1, test_count, tests[i].name);
+    if (tests[i].run()) printf("Success!\n");
+    else {
+      printf("Failed!\n");
+      return 1;
+    }
+  }
+  return 0;
+}
+#endif // TABLES_NO_MAIN
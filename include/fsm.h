@@ -1,82 +1,1512 @@
 #ifndef   FSM_H_
 #define   FSM_H_
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdio.h>
+
+#define FSM_ALIGNMENT 64
+#define FSM_INITIAL_CAPACITY 16
 
 typedef uint32_t fsm_state_t;
 typedef uint32_t fsm_event_t;
-typedef fsm_state_t *fsm_column_t;
 
+#define FSM_MAX_CLASSES 256
+#define FSM_NO_STATE UINT32_MAX
+#define FSM_MULTI_LANES 8
+#define FSM_PARALLEL_WINDOW 256
+#define FSM_SHUFFLE_BLOCK 64
+#define FSM_FILE_MAGIC "FSMT"
+#define FSM_FILE_VERSION 1
+#define FSM_FILE_HEADER_SIZE FSM_ALIGNMENT
+#ifndef FSM_PARALLEL_MIN_CHUNK
+#define FSM_PARALLEL_MIN_CHUNK (64*1024)
+#endif
+
+// Every table block comes from `alloc` and goes back through `free`, which
+// gets the size that was asked for. `alloc` must return FSM_ALIGNMENT
+// aligned memory or NULL.
+typedef struct {
+  void *(*alloc)(void *user, size_t size);
+  void (*free)(void *user, void *ptr, size_t size);
+  void *user;
+} fsm_allocator_t;
+
+// Bump allocator over a caller-provided buffer. Frees only give memory back
+// when they release the most recent allocation; fsm_arena_reset drops all.
+typedef struct {
+  uint8_t *base;
+  size_t size;
+  size_t used;
+} fsm_arena_t;
+
+// Transitions live in a single aligned block of capacity*class_count cells,
+// row `state` starts at cell state*class_count. Cells are fsm_state_t wide
+// until fsm_compact freezes the table into 1 or 2 byte cells.
+//
+// Without fsm_compress_events every event is its own class. Afterwards
+// `classes` maps each event to its column.
+//
+// The block holds the cells, then the `accept` bitset (one bit per state),
+// then the class map. `dead` is the designated sink, FSM_NO_STATE if none.
+//
+// Frozen tables whose targets all fit in 16 (or 64) lanes also get a
+// transposed copy, `shuffle`: 256 rows of shuffle_width bytes, one per input
+// byte, that fsm_run_bytes steps with pshufb (or vpermb). The rows are only
+// added when the CPU that freezes the table has the instruction.
+//
+// Tables loaded with fsm_map point into a read-only `mapping` of the file,
+// all others own `block_size` bytes from `allocator` (NULL means malloc).
 typedef struct {
   fsm_state_t state;
   size_t event_count;
-  fsm_column_t *items;
+  void *items;
   size_t capacity;
   size_t count;
+  uint8_t cell_size;
+  bool frozen;
+  uint8_t *classes;
+  size_t class_count;
+  uint64_t *accept;
+  fsm_state_t dead;
+  uint8_t *shuffle;
+  uint8_t shuffle_width;
+  void *mapping;
+  size_t mapping_size;
+  const fsm_allocator_t *allocator;
+  size_t block_size;
 } fsm_t;
 
+typedef struct {
+  fsm_state_t state;
+  size_t consumed;
+} fsm_run_t;
+
+// A position in a table shared between threads. Cursors only read the
+// table, so any number of them can walk one fsm_t as long as nothing
+// modifies it (fsm_compact freezes it for good). Each cursor fills a cache
+// line, so an FSM_ALIGNMENT aligned array of them, one per thread, has no
+// false sharing.
+typedef struct {
+  const fsm_t *fsm;
+  fsm_state_t state;
+  uint8_t padding[FSM_ALIGNMENT - sizeof(const fsm_t*) - sizeof(fsm_state_t)];
+} fsm_cursor_t;
+
+#ifdef __GNUC__
+// A frozen table that can be replaced while other threads run it, built on
+// the GCC/Clang __atomic builtins. Readers bracket every use with
+// fsm_shared_enter/fsm_shared_leave, which only store to their own
+// fsm_reader_t. fsm_shared_publish swaps in a new table and retires the old
+// one; it is freed once every reader that might still see it has left.
+//
+// Publishing, reclaiming, unregistering and freeing are for one writer at a
+// time. Readers register once and must stay alive until the writer
+// unregisters them or the fsm_shared_t goes away.
+typedef struct fsm_reader_t {
+  uint64_t epoch; // 0 outside, otherwise the epoch seen on entering
+  struct fsm_reader_t *next;
+  uint8_t padding[FSM_ALIGNMENT - sizeof(uint64_t) - sizeof(struct fsm_reader_t*)];
+} fsm_reader_t;
+
+typedef struct fsm__version_t {
+  fsm_t fsm;
+  uint64_t epoch; // Retired tables: first epoch that cannot see them
+  struct fsm__version_t *next;
+} fsm__version_t;
+
+typedef struct {
+  fsm__version_t *current;
+  uint64_t epoch;
+  fsm_reader_t *readers;
+  fsm__version_t *retired;
+} fsm_shared_t;
+#endif // __GNUC__
+
+typedef enum {
+  FSM_EMIT_TABLE,
+  FSM_EMIT_SWITCH,
+} fsm_emit_t;
+
+bool fsm_reserve(fsm_t *fsm, size_t capacity);
 fsm_state_t fsm_push_empty(fsm_t *fsm);
+void fsm_clear(fsm_t *fsm);
 void fsm_set(fsm_t *fsm, fsm_state_t column, fsm_event_t row, fsm_state_t state);
 fsm_state_t fsm_get(fsm_t fsm, fsm_state_t column, fsm_event_t row);
 fsm_state_t fsm_fire_event(fsm_t *fsm, fsm_event_t event);
-void fsm_duplicate(fsm_t *fsm, fsm_state_t from);
+fsm_state_t fsm_fire_event8(fsm_t *fsm, fsm_event_t event);
+fsm_state_t fsm_fire_event16(fsm_t *fsm, fsm_event_t event);
+fsm_state_t fsm_fire_event32(fsm_t *fsm, fsm_event_t event);
+bool fsm_compact(fsm_t *fsm);
+bool fsm_compress_events(fsm_t *fsm);
+fsm_run_t fsm_run(fsm_t *fsm, const fsm_event_t *events, size_t n);
+fsm_run_t fsm_run_bytes(fsm_t *fsm, const uint8_t *bytes, size_t n);
+fsm_run_t fsm_scan(fsm_t *fsm, const fsm_event_t *events, size_t n);
+fsm_run_t fsm_scan_bytes(fsm_t *fsm, const uint8_t *bytes, size_t n);
+void fsm_run_multi(fsm_t fsm, const uint8_t *const *inputs, const size_t *lens, fsm_state_t *states_out, size_t n);
+fsm_run_t fsm_run_parallel(fsm_t fsm, const uint8_t *bytes, size_t n, size_t threads);
+fsm_cursor_t fsm_cursor(const fsm_t *fsm);
+void fsm_cursor_reset(fsm_cursor_t *cursor);
+fsm_state_t fsm_cursor_fire(fsm_cursor_t *cursor, fsm_event_t event);
+fsm_run_t fsm_cursor_run(fsm_cursor_t *cursor, const fsm_event_t *events, size_t n);
+fsm_run_t fsm_cursor_run_bytes(fsm_cursor_t *cursor, const uint8_t *bytes, size_t n);
+fsm_run_t fsm_cursor_scan(fsm_cursor_t *cursor, const fsm_event_t *events, size_t n);
+fsm_run_t fsm_cursor_scan_bytes(fsm_cursor_t *cursor, const uint8_t *bytes, size_t n);
+#ifdef __GNUC__
+void fsm_shared_init(fsm_shared_t *shared);
+bool fsm_shared_publish(fsm_shared_t *shared, fsm_t fsm);
+size_t fsm_shared_reclaim(fsm_shared_t *shared);
+void fsm_shared_register(fsm_shared_t *shared, fsm_reader_t *reader);
+void fsm_shared_unregister(fsm_shared_t *shared, fsm_reader_t *reader);
+const fsm_t *fsm_shared_enter(fsm_shared_t *shared, fsm_reader_t *reader);
+void fsm_shared_leave(fsm_reader_t *reader);
+void fsm_shared_free(fsm_shared_t *shared);
+#endif // __GNUC__
+void fsm_set_accepting(fsm_t *fsm, fsm_state_t state, bool accepting);
+bool fsm_is_accepting(fsm_t fsm, fsm_state_t state);
+void fsm_set_dead(fsm_t *fsm, fsm_state_t state);
+bool fsm_is_dead(fsm_t fsm, fsm_state_t state);
+fsm_state_t fsm_duplicate(fsm_t *fsm, fsm_state_t from);
+bool fsm_minimize(fsm_t fsm, fsm_t *min, fsm_state_t *remap);
+bool fsm_reorder(fsm_t *fsm, const uint64_t *visits, fsm_state_t *remap);
 void fsm_dump(fsm_t fsm);
+bool fsm_emit_c(fsm_t fsm, FILE *out, const char *name, fsm_emit_t mode);
+bool fsm_save(fsm_t fsm, const char *path);
+bool fsm_map(fsm_t *fsm, const char *path);
 void fsm_free(fsm_t fsm);
 
 void fsm_init(fsm_t *fsm, size_t event_count);
+void fsm_init_with(fsm_t *fsm, size_t event_count, const fsm_allocator_t *allocator);
+
+void fsm_arena_init(fsm_arena_t *arena, void *buffer, size_t size);
+void fsm_arena_reset(fsm_arena_t *arena);
+fsm_allocator_t fsm_arena_allocator(fsm_arena_t *arena);
+
+#ifdef FSM_PROFILE
+// Hit counters for one table layout. While a profile is attached to a
+// thread, every step that thread's runners take on the matching table bumps
+// visits[state] and transitions[state*class_count + class], the cell read.
+// Tables change identity when fsm_compact, fsm_compress_events or growth
+// move `items`, so attach after the table has its final shape.
+//
+// Without FSM_PROFILE none of this exists and the runners are unchanged.
+typedef struct {
+  const void *items;
+  size_t state_count;
+  size_t class_count;
+  uint64_t *visits;
+  uint64_t *transitions;
+} fsm_profile_t;
+
+bool fsm_profile_init(fsm_profile_t *profile, fsm_t fsm);
+fsm_profile_t *fsm_profile_attach(fsm_profile_t *profile);
+void fsm_profile_reset(fsm_profile_t *profile);
+bool fsm_profile_merge(fsm_profile_t *into, const fsm_profile_t *from);
+void fsm_profile_dump(fsm_t fsm, const fsm_profile_t *profile, FILE *out);
+void fsm_profile_free(fsm_profile_t profile);
+#endif // FSM_PROFILE
 
 #ifdef FSM_IMPLEMENTATION
 
-#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !defined(FSM_NO_SIMD)
+#define FSM__X86_SIMD
+#include <immintrin.h>
+#endif
+
+#if defined(_WIN32) && !defined(FSM_NO_THREADS)
+#define FSM_NO_THREADS
+#endif
+
+#ifndef FSM_NO_THREADS
+#include <pthread.h>
+#endif
+
+#if defined(_WIN32) && !defined(FSM_NO_MMAP)
+#define FSM_NO_MMAP
+#endif
+
+#ifndef FSM_NO_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+void *fsm__alloc(const fsm_allocator_t *allocator, size_t size) {
+  if (size == 0) size = 1;
+  if (allocator) return allocator->alloc(allocator->user, size);
+  // Over-allocate and stash the raw pointer right before the aligned one
+  if (size > SIZE_MAX - FSM_ALIGNMENT - sizeof(void*)) return NULL;
+  uint8_t *raw = malloc(size + FSM_ALIGNMENT + sizeof(void*));
+  if (!raw) return NULL;
+  uintptr_t aligned = ((uintptr_t)(raw + sizeof(void*)) + FSM_ALIGNMENT-1) & ~(uintptr_t)(FSM_ALIGNMENT-1);
+  ((void**)aligned)[-1] = raw;
+  return (void*)aligned;
+}
+
+void fsm__free(const fsm_allocator_t *allocator, void *ptr, size_t size) {
+  if (!ptr) return;
+  if (allocator) allocator->free(allocator->user, ptr, size > 0 ? size : 1);
+  else free(((void**)ptr)[-1]);
+}
+
+void *fsm__arena_alloc(void *user, size_t size) {
+  fsm_arena_t *arena = user;
+  uintptr_t base = (uintptr_t)arena->base;
+  size_t start = ((base + arena->used + FSM_ALIGNMENT-1) & ~(uintptr_t)(FSM_ALIGNMENT-1)) - base;
+  if (start > arena->size || size > arena->size - start) return NULL;
+  arena->used = start + size;
+  return arena->base + start;
+}
+
+void fsm__arena_free(void *user, void *ptr, size_t size) {
+  fsm_arena_t *arena = user;
+  size_t start = (size_t)((uint8_t*)ptr - arena->base);
+  if (start + size == arena->used) arena->used = start;
+}
+
+void fsm_arena_init(fsm_arena_t *arena, void *buffer, size_t size) {
+  assert(arena && (buffer || size == 0));
+  arena->base = buffer;
+  arena->size = size;
+  arena->used = 0;
+}
+
+void fsm_arena_reset(fsm_arena_t *arena) {
+  assert(arena);
+  arena->used = 0;
+}
+
+fsm_allocator_t fsm_arena_allocator(fsm_arena_t *arena) {
+  fsm_allocator_t allocator = { fsm__arena_alloc, fsm__arena_free, arena };
+  return allocator;
+}
+
+// Gives the table's block back to wherever it came from
+void fsm__release(fsm_t fsm) {
+#ifndef FSM_NO_MMAP
+  if (fsm.mapping) {
+    munmap(fsm.mapping, fsm.mapping_size);
+    return;
+  }
+#endif
+  fsm__free(fsm.allocator, fsm.items, fsm.block_size);
+}
+
 bool fsm_initialized(fsm_t fsm) {
   return fsm.event_count > 0;
 }
 
 void fsm_init(fsm_t *fsm, size_t event_count) {
+  fsm_init_with(fsm, event_count, NULL);
+}
+
+void fsm_init_with(fsm_t *fsm, size_t event_count, const fsm_allocator_t *allocator) {
   assert(fsm);
   if (fsm->event_count != 0) return; // Already initialized
+  fsm->allocator = allocator;
   fsm->event_count = event_count;
+  fsm->cell_size = sizeof(fsm_state_t);
+  fsm->class_count = event_count;
+  fsm->dead = FSM_NO_STATE;
 }
 
+size_t fsm__accept_offset(size_t cells_size) {
+  return (cells_size + sizeof(uint64_t)-1) & ~(sizeof(uint64_t)-1);
+}
+
+size_t fsm__accept_words(size_t states) {
+  return (states + 63)/64;
+}
+
+typedef struct {
+  size_t accept;
+  size_t classes;
+  size_t shuffle;
+  size_t size;
+} fsm__layout_t;
+
+// Offsets inside a frozen block: cells, accept bits, class map, shuffle rows
+fsm__layout_t fsm__frozen_layout(size_t count, size_t class_count, uint8_t cell_size, bool classes, uint8_t shuffle_width) {
+  fsm__layout_t layout;
+  layout.accept = fsm__accept_offset(cell_size * count * class_count);
+  layout.classes = layout.accept + sizeof(uint64_t) * fsm__accept_words(count);
+  layout.shuffle = (layout.classes + (classes ? FSM_MAX_CLASSES : 0) + FSM_ALIGNMENT-1) & ~(size_t)(FSM_ALIGNMENT-1);
+  layout.size = shuffle_width ? layout.shuffle + 256*(size_t)shuffle_width : layout.shuffle;
+  return layout;
+}
+
+fsm_event_t fsm__class(fsm_t fsm, fsm_event_t event) {
+  return fsm.classes ? fsm.classes[event] : event;
+}
+
+fsm_state_t fsm__cell(fsm_t fsm, size_t index) {
+  switch (fsm.cell_size) {
+  case 1:  return ((uint8_t*)fsm.items)[index];
+  case 2:  return ((uint16_t*)fsm.items)[index];
+  default: return ((fsm_state_t*)fsm.items)[index];
+  }
+}
+
+fsm_state_t *fsm__row(fsm_t *fsm, fsm_state_t state) {
+  assert(!fsm->frozen && "Table is read-only after fsm_compact");
+  return (fsm_state_t*)fsm->items + (size_t)state * fsm->event_count;
+}
+
+// Grows the table to hold `capacity` states. Returns false, leaving the
+// table as it was, if the allocator runs out.
+bool fsm_reserve(fsm_t *fsm, size_t capacity) {
+  assert(fsm);
+  assert(!fsm->frozen);
+  if (capacity <= fsm->capacity) return true;
+  if (fsm->event_count > 0 && capacity > SIZE_MAX / sizeof(fsm_state_t) / fsm->event_count) return false;
+  size_t accept_offset = fsm__accept_offset(sizeof(fsm_state_t) * capacity * fsm->event_count);
+  size_t block_size = accept_offset + sizeof(uint64_t) * fsm__accept_words(capacity);
+  uint8_t *items = fsm__alloc(fsm->allocator, block_size);
+  if (!items) return false;
+  uint64_t *accept = (uint64_t*)(items + accept_offset);
+  memset(accept, 0, sizeof(uint64_t) * fsm__accept_words(capacity));
+  if (fsm->items) {
+    memcpy(items, fsm->items, sizeof(fsm_state_t) * fsm->count * fsm->event_count);
+    memcpy(accept, fsm->accept, sizeof(uint64_t) * fsm__accept_words(fsm->count));
+    fsm__free(fsm->allocator, fsm->items, fsm->block_size);
+  }
+  fsm->items = items;
+  fsm->accept = accept;
+  fsm->capacity = capacity;
+  fsm->block_size = block_size;
+  return true;
+}
+
+// Appends a state with every transition going to 0. Returns FSM_NO_STATE
+// if the table could not grow.
 fsm_state_t fsm_push_empty(fsm_t *fsm) {
   assert(fsm);
   if (fsm->count >= fsm->capacity) {
-    if (fsm->capacity == 0) fsm->capacity = 16;
-    else fsm->capacity *= 2;
-    fsm->items = realloc(fsm->items, sizeof(*fsm->items) * fsm->capacity);
-    assert(fsm->items && "Buy more RAM lol");
+    if (!fsm_reserve(fsm, fsm->capacity == 0 ? FSM_INITIAL_CAPACITY : fsm->capacity*2)) return FSM_NO_STATE;
   }
-  fsm->items[fsm->count] = calloc(sizeof(**fsm->items), fsm->event_count);
+  memset(fsm__row(fsm, fsm->count), 0, sizeof(fsm_state_t) * fsm->event_count);
+  fsm->accept[fsm->count/64] &= ~(1ULL << fsm->count%64);
   return fsm->count++;
 }
 
+// Drops every state but keeps the block, so a table that is rebuilt over
+// and over (a cache, say) does not go back to the allocator.
+void fsm_clear(fsm_t *fsm) {
+  assert(fsm);
+  assert(!fsm->frozen);
+  fsm->count = 0;
+  fsm->state = 0;
+  fsm->dead = FSM_NO_STATE;
+}
+
 void fsm_set(fsm_t *fsm, fsm_state_t column, fsm_event_t row, fsm_state_t state) {
   assert(fsm);
-  assert(column <= fsm->count);
-  assert(row <= fsm->event_count);
-  fsm->items[column][row] = state;
+  assert(column < fsm->count);
+  assert(row < fsm->event_count);
+  fsm__row(fsm, column)[row] = state;
 }
 
 fsm_state_t fsm_get(fsm_t fsm, fsm_state_t column, fsm_event_t row) {
-  assert(column <= fsm.count);
-  assert(row <= fsm.event_count);
-  return fsm.items[column][row];
+  assert(column < fsm.count);
+  assert(row < fsm.event_count);
+  return fsm__cell(fsm, (size_t)column * fsm.class_count + fsm__class(fsm, row));
+}
+
+#ifdef FSM_PROFILE
+#ifdef _MSC_VER
+#define FSM__THREAD_LOCAL __declspec(thread)
+#else
+#define FSM__THREAD_LOCAL __thread
+#endif
+
+FSM__THREAD_LOCAL fsm_profile_t *fsm__profile = NULL;
+
+// The calling thread's profile if it was made for exactly this table
+fsm_profile_t *fsm__profile_for(const fsm_t *fsm) {
+  fsm_profile_t *profile = fsm__profile;
+  if (!profile || profile->items != fsm->items) return NULL;
+  if (profile->state_count != fsm->count || profile->class_count != fsm->class_count) return NULL;
+  return profile;
 }
 
+#define FSM__PROFILE_DECLARE(fsm) fsm_profile_t *profile = fsm__profile_for(fsm)
+#define FSM__PROFILE_STEP(state, cell)                                         \
+  do {                                                                        \
+    if (profile) {                                                            \
+      ++profile->visits[state];                                               \
+      ++profile->transitions[cell];                                           \
+    }                                                                         \
+  } while (0)
+#define FSM__PROFILING(fsm) (fsm__profile_for(fsm) != NULL)
+#else
+#define FSM__PROFILE_DECLARE(fsm) (void)0
+#define FSM__PROFILE_STEP(state, cell) (void)0
+#define FSM__PROFILING(fsm) false
+#endif // FSM_PROFILE
+
 fsm_state_t fsm_fire_event(fsm_t *fsm, fsm_event_t event) {
-  assert(event <= fsm->event_count);
-  return fsm->state = fsm->items[fsm->state][event];
+  switch (fsm->cell_size) {
+  case 1:  return fsm_fire_event8(fsm, event);
+  case 2:  return fsm_fire_event16(fsm, event);
+  default: return fsm_fire_event32(fsm, event);
+  }
+}
+
+fsm_state_t fsm_fire_event8(fsm_t *fsm, fsm_event_t event) {
+  assert(fsm->cell_size == 1);
+  assert(fsm->state < fsm->count);
+  assert(event < fsm->event_count);
+  size_t cell = (size_t)fsm->state * fsm->class_count + fsm__class(*fsm, event);
+  FSM__PROFILE_DECLARE(fsm);
+  FSM__PROFILE_STEP(fsm->state, cell);
+  return fsm->state = ((uint8_t*)fsm->items)[cell];
+}
+
+fsm_state_t fsm_fire_event16(fsm_t *fsm, fsm_event_t event) {
+  assert(fsm->cell_size == 2);
+  assert(fsm->state < fsm->count);
+  assert(event < fsm->event_count);
+  size_t cell = (size_t)fsm->state * fsm->class_count + fsm__class(*fsm, event);
+  FSM__PROFILE_DECLARE(fsm);
+  FSM__PROFILE_STEP(fsm->state, cell);
+  return fsm->state = ((uint16_t*)fsm->items)[cell];
+}
+
+fsm_state_t fsm_fire_event32(fsm_t *fsm, fsm_event_t event) {
+  assert(fsm->cell_size == 4);
+  assert(fsm->state < fsm->count);
+  assert(event < fsm->event_count);
+  size_t cell = (size_t)fsm->state * fsm->class_count + fsm__class(*fsm, event);
+  FSM__PROFILE_DECLARE(fsm);
+  FSM__PROFILE_STEP(fsm->state, cell);
+  return fsm->state = ((fsm_state_t*)fsm->items)[cell];
 }
 
-void fsm_duplicate(fsm_t *fsm, fsm_state_t from) {
+#define FSM__ACCEPTING(accept, state) (((accept)[(state)/64] >> ((state)%64)) & 1)
+
+// Steps `run.state` over `input` until it is exhausted, the machine leaves
+// the table or hits the dead state (or an accepting one with `stop_accept`).
+// Expanded once per cell width so the loop only touches locals.
+#define FSM__RUN_LOOP(cell_t, input, n, run, stop_accept)                      \
+  do {                                                                        \
+    const cell_t *cells = (const cell_t*)fsm->items;                          \
+    const uint8_t *classes = fsm->classes;                                    \
+    const uint64_t *accept = fsm->accept;                                     \
+    size_t stride = fsm->class_count, count = fsm->count;                     \
+    size_t event_count = fsm->event_count;                                    \
+    fsm_state_t state = (run).state, dead = fsm->dead;                        \
+    size_t i = 0;                                                             \
+    FSM__PROFILE_DECLARE(fsm);                                                \
+    (void)event_count;                                                        \
+    (void)accept;                                                             \
+    if (classes) {                                                            \
+      for (; i < (n) && state < count && state != dead                        \
+             && !((stop_accept) && FSM__ACCEPTING(accept, state)); ++i) {     \
+        assert((input)[i] < event_count);                                     \
+        size_t cell = state*stride + classes[(input)[i]];                     \
+        FSM__PROFILE_STEP(state, cell);                                       \
+        state = cells[cell];                                                  \
+      }                                                                       \
+    } else {                                                                  \
+      for (; i < (n) && state < count && state != dead                        \
+             && !((stop_accept) && FSM__ACCEPTING(accept, state)); ++i) {     \
+        assert((input)[i] < event_count);                                     \
+        size_t cell = state*stride + (input)[i];                              \
+        FSM__PROFILE_STEP(state, cell);                                       \
+        state = cells[cell];                                                  \
+      }                                                                       \
+    }                                                                         \
+    (run).state = state;                                                      \
+    (run).consumed = i;                                                       \
+  } while (0)
+
+#define FSM__RUN(input, n, stop_accept)                                        \
+  do {                                                                        \
+    assert(fsm);                                                              \
+    fsm_run_t run = { .state = fsm->state, .consumed = 0 };                   \
+    switch (fsm->cell_size) {                                                 \
+    case 1:  FSM__RUN_LOOP(uint8_t, input, n, run, stop_accept); break;       \
+    case 2:  FSM__RUN_LOOP(uint16_t, input, n, run, stop_accept); break;      \
+    default: FSM__RUN_LOOP(fsm_state_t, input, n, run, stop_accept); break;   \
+    }                                                                         \
+    fsm->state = run.state;                                                   \
+    return run;                                                               \
+  } while (0)
+
+// Fires `n` events starting from fsm->state. Stops early once the machine
+// reaches the dead state or leaves the table (a target >= fsm->count).
+// Returns the last state and how many events were consumed.
+fsm_run_t fsm_run(fsm_t *fsm, const fsm_event_t *events, size_t n) {
+  FSM__RUN(events, n, false);
+}
+
+fsm_run_t fsm__run_bytes_table(fsm_t *fsm, const uint8_t *bytes, size_t n) {
+  FSM__RUN(bytes, n, false);
+}
+
+#ifdef FSM__X86_SIMD
+const uint8_t fsm__identity[64] = {
+   0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15,
+  16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31,
+  32, 33, 34, 35, 36, 37, 38, 39, 40, 41, 42, 43, 44, 45, 46, 47,
+  48, 49, 50, 51, 52, 53, 54, 55, 56, 57, 58, 59, 60, 61, 62, 63,
+};
+
+// Bit 0: SSSE3 pshufb, bit 1: AVX-512 VBMI vpermb. Threads that race on
+// the first call all store the same answer.
+int fsm__simd_support(void) {
+  static int cached = -1;
+  int support = __atomic_load_n(&cached, __ATOMIC_RELAXED);
+  if (support < 0) {
+    __builtin_cpu_init();
+    support = (__builtin_cpu_supports("ssse3") ? 1 : 0)
+            | (__builtin_cpu_supports("avx512vbmi") && __builtin_cpu_supports("avx512bw") ? 2 : 0);
+    __atomic_store_n(&cached, support, __ATOMIC_RELAXED);
+  }
+  return support;
+}
+
+// Composes the transitions of `n` bytes for all 16 (or 64) states at once:
+// lane s of `map` ends up holding where state s goes. The table loads only
+// depend on the input, so the dependency chain is one shuffle per byte.
+__attribute__((target("ssse3")))
+void fsm__shuffle_block16(const uint8_t *table, const uint8_t *bytes, size_t n, uint8_t *map) {
+  __m128i v = _mm_loadu_si128((const __m128i*)fsm__identity);
+  for (size_t i = 0; i < n; ++i) {
+    v = _mm_shuffle_epi8(_mm_load_si128((const __m128i*)(table + 16*bytes[i])), v);
+  }
+  _mm_storeu_si128((__m128i*)map, v);
+}
+
+__attribute__((target("avx512f,avx512bw,avx512vbmi")))
+void fsm__shuffle_block64(const uint8_t *table, const uint8_t *bytes, size_t n, uint8_t *map) {
+  __m512i v = _mm512_loadu_si512(fsm__identity);
+  for (size_t i = 0; i < n; ++i) {
+    v = _mm512_permutexvar_epi8(v, _mm512_load_si512(table + 64*bytes[i]));
+  }
+  _mm512_storeu_si512(map, v);
+}
+
+// Walks the input FSM_SHUFFLE_BLOCK bytes at a time. Dead and exit states
+// are absorbing in the shuffle table, so when a block ends on one of them
+// it is replayed on the scalar table to get the exact stopping point.
+bool fsm__run_shuffle(fsm_t *fsm, const uint8_t *bytes, size_t n, fsm_run_t *run) {
+  int support = fsm__simd_support();
+  void (*block)(const uint8_t*, const uint8_t*, size_t, uint8_t*) = NULL;
+  if (fsm->shuffle_width == 16 && (support & 1)) block = fsm__shuffle_block16;
+  else if (fsm->shuffle_width == 64 && (support & 2)) block = fsm__shuffle_block64;
+  if (!block) return false;
+
+  fsm_state_t state = fsm->state;
+  size_t i = 0;
+  while (i < n && state < fsm->count && state != fsm->dead) {
+    size_t len = n - i < FSM_SHUFFLE_BLOCK ? n - i : FSM_SHUFFLE_BLOCK;
+    uint8_t map[64];
+    block(fsm->shuffle, bytes + i, len, map);
+    fsm_state_t next = map[state];
+    if (next >= fsm->count || next == fsm->dead) {
+      fsm->state = state;
+      fsm_run_t tail = fsm__run_bytes_table(fsm, bytes + i, len);
+      run->state = tail.state;
+      run->consumed = i + tail.consumed;
+      return true;
+    }
+    state = next;
+    i += len;
+  }
+  run->state = state;
+  run->consumed = i;
+  return true;
+}
+#endif // FSM__X86_SIMD
+
+fsm_run_t fsm_run_bytes(fsm_t *fsm, const uint8_t *bytes, size_t n) {
+#ifdef FSM__X86_SIMD
+  fsm_run_t run;
+  // A profiled run has to see every step, which the shuffles skip over
+  if (fsm->shuffle && !FSM__PROFILING(fsm) && fsm__run_shuffle(fsm, bytes, n, &run)) {
+    fsm->state = run.state;
+    return run;
+  }
+#endif
+  return fsm__run_bytes_table(fsm, bytes, n);
+}
+
+// Like fsm_run, but also stops as soon as an accepting state is current,
+// so callers can report a match and resume from the returned position.
+fsm_run_t fsm_scan(fsm_t *fsm, const fsm_event_t *events, size_t n) {
+  FSM__RUN(events, n, true);
+}
+
+fsm_run_t fsm_scan_bytes(fsm_t *fsm, const uint8_t *bytes, size_t n) {
+  FSM__RUN(bytes, n, true);
+}
+
+// Advances FSM_MULTI_LANES streams in lockstep so their table loads are
+// independent and can be in flight at the same time. Within a round every
+// live lane takes as many steps as the shortest one has left, and a lane that
+// stops drops out with nothing left so it is never advanced past its end.
+#define FSM__MULTI_LOOP(cell_t)                                                \
+  do {                                                                        \
+    const cell_t *cells = (const cell_t*)fsm.items;                           \
+    for (size_t base = 0; base < n; base += FSM_MULTI_LANES) {                \
+      size_t lanes = n - base < FSM_MULTI_LANES ? n - base : FSM_MULTI_LANES; \
+      fsm_state_t state[FSM_MULTI_LANES];                                     \
+      const uint8_t *input[FSM_MULTI_LANES];                                  \
+      size_t left[FSM_MULTI_LANES];                                           \
+      for (size_t j = 0; j < lanes; ++j) {                                    \
+        state[j] = fsm.state;                                                 \
+        input[j] = inputs[base + j];                                          \
+        left[j] = lens[base + j];                                             \
+      }                                                                       \
+      for (;;) {                                                              \
+        size_t step = SIZE_MAX;                                               \
+        for (size_t j = 0; j < lanes; ++j) {                                  \
+          if (left[j] == 0 || state[j] >= count || state[j] == dead) continue;\
+          if (left[j] < step) step = left[j];                                 \
+        }                                                                     \
+        if (step == SIZE_MAX) break;                                          \
+        for (size_t i = 0; i < step; ++i) {                                   \
+          for (size_t j = 0; j < lanes; ++j) {                                \
+            fsm_state_t s = state[j];                                         \
+            if (left[j] == 0 || s >= count || s == dead) continue;            \
+            uint8_t byte = input[j][i];                                       \
+            assert(byte < fsm.event_count);                                   \
+            size_t cell = s*stride + (classes ? classes[byte] : byte);        \
+            FSM__PROFILE_STEP(s, cell);                                       \
+            state[j] = cells[cell];                                           \
+          }                                                                   \
+        }                                                                     \
+        for (size_t j = 0; j < lanes; ++j) {                                  \
+          if (state[j] >= count || state[j] == dead) left[j] = 0;             \
+          if (left[j] == 0) continue;                                         \
+          left[j] -= step;                                                    \
+          input[j] += step;                                                   \
+        }                                                                     \
+      }                                                                       \
+      for (size_t j = 0; j < lanes; ++j) states_out[base + j] = state[j];     \
+    }                                                                         \
+  } while (0)
+
+// Runs `n` independent byte streams from fsm.state with the same stopping
+// rules as fsm_run_bytes and stores where each one ended in states_out.
+void fsm_run_multi(fsm_t fsm, const uint8_t *const *inputs, const size_t *lens, fsm_state_t *states_out, size_t n) {
+  assert(n == 0 || (inputs && lens && states_out));
+  const uint8_t *classes = fsm.classes;
+  size_t stride = fsm.class_count, count = fsm.count;
+  fsm_state_t dead = fsm.dead;
+  FSM__PROFILE_DECLARE(&fsm);
+  switch (fsm.cell_size) {
+  case 1:  FSM__MULTI_LOOP(uint8_t); break;
+  case 2:  FSM__MULTI_LOOP(uint16_t); break;
+  default: FSM__MULTI_LOOP(fsm_state_t); break;
+  }
+}
+
+typedef struct {
+  fsm_t fsm;
+  const uint8_t *bytes;
+  size_t n;
+  fsm_state_t *map;
+  // Scratch of count+1 entries each, handed out by fsm_run_parallel
+  fsm_state_t *lanes;
+  size_t *owner;
+  size_t *slot;
+  size_t *moved;
+#ifndef FSM_NO_THREADS
+  pthread_t worker;
+  bool spawned;
+#endif
+} fsm__chunk_t;
+
+// Maps every start state to where fsm_run_bytes would leave it after
+// `bytes`. All states are walked together window by window; after each
+// window lanes that landed on the same state are merged, which usually
+// collapses them to a handful within a few hundred bytes.
+void fsm__chunk_map(fsm__chunk_t *chunk) {
+  fsm_t fsm = chunk->fsm;
+  const uint8_t *bytes = chunk->bytes;
+  size_t n = chunk->n, count = fsm.count;
+  fsm_state_t *lanes = chunk->lanes, *map = chunk->map;
+  size_t *owner = chunk->owner, *slot = chunk->slot, *moved = chunk->moved;
+  size_t lane_count = count;
+  for (size_t s = 0; s < count; ++s) {
+    lanes[s] = (fsm_state_t)s;
+    owner[s] = s;
+    slot[s] = SIZE_MAX;
+  }
+
+  for (size_t off = 0; off < n; off += FSM_PARALLEL_WINDOW) {
+    size_t len = n - off < FSM_PARALLEL_WINDOW ? n - off : FSM_PARALLEL_WINDOW;
+    bool live = false;
+    for (size_t i = 0; i < lane_count; ++i) {
+      fsm.state = lanes[i];
+      lanes[i] = fsm_run_bytes(&fsm, bytes + off, len).state;
+      live = live || (lanes[i] < count && lanes[i] != fsm.dead);
+    }
+
+    // Exit targets past the table are never merged, there are few of them
+    size_t merged = 0;
+    for (size_t i = 0; i < lane_count; ++i) {
+      fsm_state_t s = lanes[i];
+      if (s < count && slot[s] != SIZE_MAX) {
+        moved[i] = slot[s];
+        continue;
+      }
+      if (s < count) slot[s] = merged;
+      lanes[merged] = s;
+      moved[i] = merged++;
+    }
+    for (size_t i = 0; i < merged; ++i) {
+      if (lanes[i] < count) slot[lanes[i]] = SIZE_MAX;
+    }
+    if (merged < lane_count) {
+      for (size_t s = 0; s < count; ++s) owner[s] = moved[owner[s]];
+    }
+    lane_count = merged;
+    if (!live) break;
+  }
+
+  for (size_t s = 0; s < count; ++s) map[s] = lanes[owner[s]];
+}
+
+void *fsm__chunk_worker(void *arg) {
+  fsm__chunk_map(arg);
+  return NULL;
+}
+
+// Splits `bytes` into `threads` chunks. The first one is run from fsm.state
+// on the calling thread, every other one is mapped from all start states on
+// its own thread, then the maps are composed in order. The result is exactly
+// what fsm_run_bytes returns: when a chunk's map leads to the dead state or
+// out of the table, that chunk is replayed from its entry state to find
+// where the run stopped.
+//
+// While the table is being profiled it is run on the calling thread alone:
+// the chunk maps walk every start state and would count steps never taken.
+// Scratch comes from the table's allocator; without it the whole input is
+// run on the calling thread too.
+fsm_run_t fsm_run_parallel(fsm_t fsm, const uint8_t *bytes, size_t n, size_t threads) {
+  if (threads < 1 || FSM__PROFILING(&fsm)) threads = 1;
+  // Every chunk gets at least FSM_PARALLEL_MIN_CHUNK bytes
+  if (n / threads < FSM_PARALLEL_MIN_CHUNK) threads = n / FSM_PARALLEL_MIN_CHUNK;
+  if (threads < 1) threads = 1;
+  size_t chunk_size = n / threads, lanes = fsm.count + 1;
+  if (threads == 1 || lanes > SIZE_MAX / 3 / sizeof(size_t) / threads) return fsm_run_bytes(&fsm, bytes, n);
+
+  // Per chunk: its map and its lanes, then owner, slot and moved
+  size_t chunks_size = sizeof(fsm__chunk_t) * threads;
+  size_t states_size = sizeof(fsm_state_t) * 2 * lanes * threads;
+  size_t indices_size = sizeof(size_t) * 3 * lanes * threads;
+  fsm__chunk_t *chunks = fsm__alloc(fsm.allocator, chunks_size);
+  fsm_state_t *states = fsm__alloc(fsm.allocator, states_size);
+  size_t *indices = fsm__alloc(fsm.allocator, indices_size);
+  if (!chunks || !states || !indices) {
+    fsm__free(fsm.allocator, chunks, chunks_size);
+    fsm__free(fsm.allocator, states, states_size);
+    fsm__free(fsm.allocator, indices, indices_size);
+    return fsm_run_bytes(&fsm, bytes, n);
+  }
+  for (size_t i = 1; i < threads; ++i) {
+    chunks[i].fsm = fsm;
+    chunks[i].bytes = bytes + i*chunk_size;
+    chunks[i].n = i + 1 == threads ? n - i*chunk_size : chunk_size;
+    chunks[i].map = states + 2*i*lanes;
+    chunks[i].lanes = states + (2*i + 1)*lanes;
+    chunks[i].owner = indices + 3*i*lanes;
+    chunks[i].slot = indices + (3*i + 1)*lanes;
+    chunks[i].moved = indices + (3*i + 2)*lanes;
+  }
+
+#ifdef FSM_NO_THREADS
+  for (size_t i = 1; i < threads; ++i) fsm__chunk_worker(&chunks[i]);
+#else
+  for (size_t i = 1; i < threads; ++i) {
+    // Fall back to the calling thread if the system is out of threads
+    chunks[i].spawned = pthread_create(&chunks[i].worker, NULL, fsm__chunk_worker, &chunks[i]) == 0;
+  }
+#endif
+
+  fsm_run_t run = fsm_run_bytes(&fsm, bytes, chunk_size);
+
+#ifndef FSM_NO_THREADS
+  for (size_t i = 1; i < threads; ++i) {
+    if (chunks[i].spawned) pthread_join(chunks[i].worker, NULL);
+    else fsm__chunk_worker(&chunks[i]);
+  }
+#endif
+
+  for (size_t i = 1; i < threads && run.consumed == i*chunk_size; ++i) {
+    if (run.state >= fsm.count || run.state == fsm.dead) break;
+    fsm_state_t next = chunks[i].map[run.state];
+    if (next < fsm.count && next != fsm.dead) {
+      run.state = next;
+      run.consumed += chunks[i].n;
+      continue;
+    }
+    fsm.state = run.state;
+    fsm_run_t tail = fsm_run_bytes(&fsm, chunks[i].bytes, chunks[i].n);
+    run.state = tail.state;
+    run.consumed += tail.consumed;
+  }
+  fsm__free(fsm.allocator, chunks, chunks_size);
+  fsm__free(fsm.allocator, states, states_size);
+  fsm__free(fsm.allocator, indices, indices_size);
+  return run;
+}
+
+// Cursors start where the table's own state is
+fsm_cursor_t fsm_cursor(const fsm_t *fsm) {
+  assert(fsm);
+  fsm_cursor_t cursor = {0};
+  cursor.fsm = fsm;
+  cursor.state = fsm->state;
+  return cursor;
+}
+
+void fsm_cursor_reset(fsm_cursor_t *cursor) {
+  assert(cursor && cursor->fsm);
+  cursor->state = cursor->fsm->state;
+}
+
+fsm_state_t fsm_cursor_fire(fsm_cursor_t *cursor, fsm_event_t event) {
+  assert(cursor && cursor->fsm);
+  const fsm_t *fsm = cursor->fsm;
+  assert(cursor->state < fsm->count);
+  assert(event < fsm->event_count);
+  size_t cell = (size_t)cursor->state * fsm->class_count + fsm__class(*fsm, event);
+  FSM__PROFILE_DECLARE(fsm);
+  FSM__PROFILE_STEP(cursor->state, cell);
+  return cursor->state = fsm__cell(*fsm, cell);
+}
+
+// The batch runners step a private copy of the table header, the shared
+// one is never written
+#define FSM__CURSOR_RUN(runner, input, n)                                      \
+  do {                                                                        \
+    assert(cursor && cursor->fsm);                                            \
+    fsm_t fsm = *cursor->fsm;                                                 \
+    fsm.state = cursor->state;                                                \
+    fsm_run_t run = runner(&fsm, input, n);                                   \
+    cursor->state = run.state;                                                \
+    return run;                                                               \
+  } while (0)
+
+fsm_run_t fsm_cursor_run(fsm_cursor_t *cursor, const fsm_event_t *events, size_t n) {
+  FSM__CURSOR_RUN(fsm_run, events, n);
+}
+
+fsm_run_t fsm_cursor_run_bytes(fsm_cursor_t *cursor, const uint8_t *bytes, size_t n) {
+  FSM__CURSOR_RUN(fsm_run_bytes, bytes, n);
+}
+
+fsm_run_t fsm_cursor_scan(fsm_cursor_t *cursor, const fsm_event_t *events, size_t n) {
+  FSM__CURSOR_RUN(fsm_scan, events, n);
+}
+
+fsm_run_t fsm_cursor_scan_bytes(fsm_cursor_t *cursor, const uint8_t *bytes, size_t n) {
+  FSM__CURSOR_RUN(fsm_scan_bytes, bytes, n);
+}
+
+#ifdef __GNUC__
+// Epoch 0 marks readers that are outside, so counting starts at 1
+void fsm_shared_init(fsm_shared_t *shared) {
+  assert(shared);
+  memset(shared, 0, sizeof(*shared));
+  shared->epoch = 1;
+}
+
+// Takes ownership of `fsm` and makes it the table readers enter with. The
+// previous one is retired and freed by this or a later reclaim. Returns
+// false, leaving `fsm` to the caller, if memory runs out.
+bool fsm_shared_publish(fsm_shared_t *shared, fsm_t fsm) {
+  assert(shared);
+  assert(fsm.frozen && "Only tables frozen by fsm_compact can be shared");
+  fsm__version_t *version = malloc(sizeof(*version));
+  if (!version) return false;
+  version->fsm = fsm;
+  version->epoch = 0;
+  version->next = NULL;
+  fsm__version_t *old = __atomic_exchange_n(&shared->current, version, __ATOMIC_SEQ_CST);
+  uint64_t epoch = __atomic_fetch_add(&shared->epoch, 1, __ATOMIC_SEQ_CST);
+  if (old) {
+    // Readers that entered before the bump may hold `old`, later ones cannot
+    old->epoch = epoch + 1;
+    old->next = shared->retired;
+    shared->retired = old;
+  }
+  fsm_shared_reclaim(shared);
+  return true;
+}
+
+// Frees every retired table no reader can still be using. Returns how many
+// are left waiting for slow readers.
+size_t fsm_shared_reclaim(fsm_shared_t *shared) {
+  assert(shared);
+  uint64_t oldest = UINT64_MAX;
+  for (fsm_reader_t *reader = __atomic_load_n(&shared->readers, __ATOMIC_SEQ_CST); reader; reader = reader->next) {
+    uint64_t epoch = __atomic_load_n(&reader->epoch, __ATOMIC_SEQ_CST);
+    if (epoch != 0 && epoch < oldest) oldest = epoch;
+  }
+  size_t waiting = 0;
+  fsm__version_t **link = &shared->retired;
+  while (*link) {
+    fsm__version_t *version = *link;
+    if (version->epoch <= oldest) {
+      *link = version->next;
+      fsm_free(version->fsm);
+      free(version);
+    } else {
+      link = &version->next;
+      ++waiting;
+    }
+  }
+  return waiting;
+}
+
+void fsm_shared_register(fsm_shared_t *shared, fsm_reader_t *reader) {
+  assert(shared && reader);
+  reader->epoch = 0;
+  reader->next = __atomic_load_n(&shared->readers, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&shared->readers, &reader->next, reader, true, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+}
+
+// Takes a reader that has left off the list, after which its memory can be
+// reused. Only the writer unlinks, so registrations racing with this can
+// only have pushed new readers in front of it.
+void fsm_shared_unregister(fsm_shared_t *shared, fsm_reader_t *reader) {
+  assert(shared && reader);
+  assert(reader->epoch == 0 && "Leave before unregistering");
+  fsm_reader_t *prev = reader;
+  if (__atomic_compare_exchange_n(&shared->readers, &prev, reader->next, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) return;
+  while (prev->next != reader) {
+    assert(prev->next && "Reader is not registered");
+    prev = prev->next;
+  }
+  __atomic_store_n(&prev->next, reader->next, __ATOMIC_SEQ_CST);
+}
+
+// Returns the current table, NULL if nothing was published yet. It stays
+// valid until fsm_shared_leave, walk it with a cursor.
+const fsm_t *fsm_shared_enter(fsm_shared_t *shared, fsm_reader_t *reader) {
+  assert(shared && reader);
+  assert(reader->epoch == 0 && "Readers do not nest");
+  // The epoch has to be visible before `current` is read, or a publish in
+  // between could free the table without having seen this reader
+  __atomic_store_n(&reader->epoch, __atomic_load_n(&shared->epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+  fsm__version_t *version = __atomic_load_n(&shared->current, __ATOMIC_SEQ_CST);
+  return version ? &version->fsm : NULL;
+}
+
+void fsm_shared_leave(fsm_reader_t *reader) {
+  assert(reader);
+  __atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+}
+
+// Frees the current and all retired tables. No reader may be inside.
+void fsm_shared_free(fsm_shared_t *shared) {
+  assert(shared);
+  fsm__version_t *version = shared->current;
+  if (version) {
+    version->next = shared->retired;
+    shared->retired = version;
+  }
+  while (shared->retired) {
+    version = shared->retired;
+    shared->retired = version->next;
+    fsm_free(version->fsm);
+    free(version);
+  }
+  shared->current = NULL;
+}
+#endif // __GNUC__
+
+void fsm_set_accepting(fsm_t *fsm, fsm_state_t state, bool accepting) {
+  assert(fsm);
+  assert(!fsm->frozen);
+  assert(state < fsm->count);
+  if (accepting) fsm->accept[state/64] |= 1ULL << state%64;
+  else fsm->accept[state/64] &= ~(1ULL << state%64);
+}
+
+bool fsm_is_accepting(fsm_t fsm, fsm_state_t state) {
+  return state < fsm.count && FSM__ACCEPTING(fsm.accept, state);
+}
+
+void fsm_set_dead(fsm_t *fsm, fsm_state_t state) {
+  assert(fsm);
+  assert(!fsm->frozen);
+  assert(state == FSM_NO_STATE || state < fsm->count);
+  fsm->dead = state;
+}
+
+bool fsm_is_dead(fsm_t fsm, fsm_state_t state) {
+  return state == fsm.dead;
+}
+
+fsm_state_t fsm_duplicate(fsm_t *fsm, fsm_state_t from) {
   assert(from < fsm->count);
   fsm_state_t new_state = fsm_push_empty(fsm);
-  for (fsm_event_t i = 0; i < fsm->event_count; ++i) fsm_set(fsm, new_state, i, fsm_get(*fsm, from, i));
+  if (new_state == FSM_NO_STATE) return FSM_NO_STATE;
+  memcpy(fsm__row(fsm, new_state), fsm__row(fsm, from), sizeof(fsm_state_t) * fsm->event_count);
+  fsm_set_accepting(fsm, new_state, fsm_is_accepting(*fsm, from));
+  return new_state;
+}
+
+// Lane s of row b is where state s goes on byte b. Lanes that are not
+// live states, the dead state and bytes outside the alphabet all stay put
+void fsm__fill_shuffle(fsm_t fsm) {
+  for (size_t b = 0; fsm.shuffle && b < 256; ++b) {
+    for (size_t s = 0; s < fsm.shuffle_width; ++s) {
+      bool live = s < fsm.count && s != fsm.dead && b < fsm.event_count;
+      fsm.shuffle[b*fsm.shuffle_width + s] = (uint8_t)(live ? fsm_get(fsm, s, b) : s);
+    }
+  }
+}
+
+// Rebuilds the table as a frozen block where cell (state, class) holds the
+// target of event reps[class]. The accept bits and `classes` (if any) follow.
+bool fsm__reencode(fsm_t *fsm, uint8_t cell_size, const uint8_t *classes, const fsm_event_t *reps, size_t class_count) {
+  fsm_state_t max = 0;
+  for (size_t s = 0; s < fsm->count; ++s) {
+    for (size_t c = 0; c < class_count; ++c) {
+      fsm_state_t cell = fsm_get(*fsm, s, reps[c]);
+      if (cell > max) max = cell;
+    }
+  }
+  uint8_t shuffle_width = 0;
+#ifdef FSM__X86_SIMD
+  // Rows cost 4 or 16 KiB, so only add the ones this CPU can shuffle with
+  int support = fsm__simd_support();
+  if ((support & 1) && fsm->count > 0 && max < 16 && fsm->count <= 16) shuffle_width = 16;
+  else if ((support & 2) && fsm->count > 0 && max < 64 && fsm->count <= 64) shuffle_width = 64;
+#endif
+
+  fsm__layout_t layout = fsm__frozen_layout(fsm->count, class_count, cell_size, classes != NULL, shuffle_width);
+  size_t accept_offset = layout.accept, classes_offset = layout.classes;
+  uint8_t *items = fsm__alloc(fsm->allocator, layout.size);
+  if (!items) return false;
+  for (size_t s = 0; s < fsm->count; ++s) {
+    for (size_t c = 0; c < class_count; ++c) {
+      fsm_state_t cell = fsm_get(*fsm, s, reps[c]);
+      size_t i = s * class_count + c;
+      switch (cell_size) {
+      case 1:  ((uint8_t*)items)[i] = (uint8_t)cell; break;
+      case 2:  ((uint16_t*)items)[i] = (uint16_t)cell; break;
+      default: ((fsm_state_t*)items)[i] = cell; break;
+      }
+    }
+  }
+  if (fsm->count > 0) memcpy(items + accept_offset, fsm->accept, sizeof(uint64_t) * fsm__accept_words(fsm->count));
+  if (classes) memcpy(items + classes_offset, classes, FSM_MAX_CLASSES);
+
+  fsm__release(*fsm);
+  fsm->mapping = NULL;
+  fsm->items = items;
+  fsm->accept = (uint64_t*)(items + accept_offset);
+  fsm->capacity = fsm->count;
+  fsm->cell_size = cell_size;
+  fsm->classes = classes ? items + classes_offset : NULL;
+  fsm->class_count = class_count;
+  fsm->shuffle = shuffle_width ? items + layout.shuffle : NULL;
+  fsm->shuffle_width = shuffle_width;
+  fsm->block_size = layout.size;
+  fsm->frozen = true;
+  fsm__fill_shuffle(*fsm);
+  return true;
+}
+
+// Re-encodes the table with the narrowest cell that holds every target
+// (exit targets past fsm->count included) and freezes it. Returns false and
+// leaves the table untouched if memory runs out.
+bool fsm_compact(fsm_t *fsm) {
+  assert(fsm);
+  size_t cells = fsm->count * fsm->class_count;
+  fsm_state_t max = 0;
+  for (size_t i = 0; i < cells; ++i) {
+    fsm_state_t cell = fsm__cell(*fsm, i);
+    if (cell > max) max = cell;
+  }
+  uint8_t cell_size = max <= UINT8_MAX ? 1 : max <= UINT16_MAX ? 2 : 4;
+
+  fsm_event_t *reps = malloc(sizeof(*reps) * (fsm->class_count + 1));
+  if (!reps) return false;
+  for (size_t e = fsm->event_count; e-- > 0;) reps[fsm__class(*fsm, e)] = e;
+  uint8_t classes[FSM_MAX_CLASSES];
+  if (fsm->classes) memcpy(classes, fsm->classes, FSM_MAX_CLASSES);
+  bool ok = fsm__reencode(fsm, cell_size, fsm->classes ? classes : NULL, reps, fsm->class_count);
+  free(reps);
+  return ok;
+}
+
+// Merges events whose columns are identical in every state into one class
+// and freezes the table. Needs at most FSM_MAX_CLASSES events and memory
+// for the new block.
+bool fsm_compress_events(fsm_t *fsm) {
+  assert(fsm);
+  if (fsm->event_count > FSM_MAX_CLASSES) return false;
+
+  uint64_t hashes[FSM_MAX_CLASSES];
+  for (size_t e = 0; e < fsm->event_count; ++e) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t s = 0; s < fsm->count; ++s) {
+      hash ^= fsm_get(*fsm, s, e);
+      hash *= 1099511628211ULL;
+    }
+    hashes[e] = hash;
+  }
+
+  uint8_t classes[FSM_MAX_CLASSES] = {0};
+  fsm_event_t reps[FSM_MAX_CLASSES];
+  size_t class_count = 0;
+  for (size_t e = 0; e < fsm->event_count; ++e) {
+    size_t c = 0;
+    for (; c < class_count; ++c) {
+      if (hashes[reps[c]] != hashes[e]) continue;
+      size_t s = 0;
+      while (s < fsm->count && fsm_get(*fsm, s, reps[c]) == fsm_get(*fsm, s, e)) ++s;
+      if (s == fsm->count) break;
+    }
+    if (c == class_count) reps[class_count++] = e;
+    classes[e] = (uint8_t)c;
+  }
+
+  return fsm__reencode(fsm, fsm->cell_size, classes, reps, class_count);
+}
+
+int fsm__compare_states(const void *a, const void *b) {
+  fsm_state_t x = *(const fsm_state_t*)a, y = *(const fsm_state_t*)b;
+  return (x > y) - (x < y);
+}
+
+// Hopcroft's partition refinement, O(n*k*log n) for n states and k event
+// classes, over the states reachable from fsm.state; the others are
+// dropped first. States start split by acceptance and every distinct exit
+// target (>= fsm.count) stays its own class. Blocks are numbered by their
+// lowest original state, so the relative order of survivors is kept; exit
+// targets keep their distance past the new count. min->state is where
+// fsm.state went.
+//
+// Fills remap[old] = new when `remap` is not NULL, FSM_NO_STATE for the
+// dropped states. The result uses the same allocator. Returns false,
+// leaving `min` untouched, if memory runs out.
+bool fsm_minimize(fsm_t fsm, fsm_t *min, fsm_state_t *remap) {
+  assert(min);
+  fsm_t result = {0};
+  fsm_init_with(&result, fsm.event_count, fsm.allocator);
+  size_t n = fsm.count, k = fsm.class_count;
+  if (n == 0) {
+    *min = result;
+    return true;
+  }
+  assert(fsm.state < n);
+
+  bool ok = false;
+  fsm_state_t *exits = malloc(sizeof(*exits) * (n*k + 1));
+  fsm_state_t *queue = malloc(sizeof(*queue) * n);
+  bool *reachable = calloc(n, sizeof(*reachable));
+  if (!exits || !queue || !reachable) {
+    free(exits);
+    free(queue);
+    free(reachable);
+    return false;
+  }
+  size_t queued = 0;
+  queue[queued++] = fsm.state;
+  reachable[fsm.state] = true;
+  for (size_t i = 0; i < queued; ++i) {
+    for (size_t c = 0; c < k; ++c) {
+      fsm_state_t t = fsm__cell(fsm, (size_t)queue[i]*k + c);
+      if (t < n && !reachable[t]) {
+        reachable[t] = true;
+        queue[queued++] = t;
+      }
+    }
+  }
+
+  size_t exit_count = 0;
+  for (size_t i = 0; i < n*k; ++i) {
+    fsm_state_t t = fsm__cell(fsm, i);
+    if (t >= n && reachable[i / k]) exits[exit_count++] = t;
+  }
+  qsort(exits, exit_count, sizeof(*exits), fsm__compare_states);
+  size_t unique = 0;
+  for (size_t i = 0; i < exit_count; ++i) {
+    if (unique == 0 || exits[unique-1] != exits[i]) exits[unique++] = exits[i];
+  }
+  exit_count = unique;
+
+  // Node i < n is state i, node n+j is exits[j]. Exits have no outgoing edges
+  size_t N = n + exit_count;
+  size_t *inv_start = calloc(k*N + 1, sizeof(*inv_start));
+  fsm_state_t *inv = malloc(sizeof(*inv) * (n*k + 1));
+  size_t *targets = malloc(sizeof(*targets) * (n*k + 1));
+  fsm_state_t *elems = malloc(sizeof(*elems) * N);
+  fsm_state_t *splitter = malloc(sizeof(*splitter) * N);
+  size_t *pos = malloc(sizeof(*pos) * N);
+  size_t *block = malloc(sizeof(*block) * N);
+  size_t *first = malloc(sizeof(*first) * N);
+  size_t *end = malloc(sizeof(*end) * N);
+  size_t *marked = malloc(sizeof(*marked) * N);
+  size_t *touched = malloc(sizeof(*touched) * N);
+  size_t *work = malloc(sizeof(*work) * (N*k + 1));
+  bool *in_work = calloc(N*k + 1, sizeof(*in_work));
+  size_t *fill = malloc(sizeof(*fill) * (k*N + 1));
+  size_t *number = malloc(sizeof(*number) * N);
+  if (!inv_start || !inv || !targets || !elems || !splitter || !pos || !block || !first || !end
+      || !marked || !touched || !work || !in_work || !fill || !number) goto done;
+
+  for (size_t s = 0; s < n; ++s) {
+    for (size_t c = 0; c < k && reachable[s]; ++c) {
+      fsm_state_t t = fsm__cell(fsm, s*k + c);
+      size_t node = t;
+      if (t >= n) {
+        fsm_state_t *exit = bsearch(&t, exits, exit_count, sizeof(*exits), fsm__compare_states);
+        node = n + (size_t)(exit - exits);
+      }
+      targets[s*k + c] = node;
+      inv_start[c*N + node + 1]++;
+    }
+  }
+  for (size_t i = 0; i < k*N; ++i) inv_start[i+1] += inv_start[i];
+  memcpy(fill, inv_start, sizeof(*fill) * (k*N + 1));
+  for (size_t s = 0; s < n; ++s) {
+    for (size_t c = 0; c < k && reachable[s]; ++c) inv[fill[c*N + targets[s*k + c]]++] = (fsm_state_t)s;
+  }
+
+  // Initial partition: non-accepting, accepting, then one block per exit
+  size_t block_count = 0, work_count = 0;
+  size_t at = 0;
+  for (int acc = 0; acc < 2; ++acc) {
+    size_t start = at;
+    for (size_t s = 0; s < n; ++s) {
+      if (!reachable[s] || fsm_is_accepting(fsm, s) != (acc == 1)) continue;
+      elems[at] = (fsm_state_t)s;
+      pos[s] = at++;
+      block[s] = block_count;
+    }
+    if (at == start) continue;
+    first[block_count] = marked[block_count] = start;
+    end[block_count++] = at;
+  }
+  for (size_t j = 0; j < exit_count; ++j) {
+    elems[at] = (fsm_state_t)(n + j);
+    pos[n + j] = at;
+    block[n + j] = block_count;
+    first[block_count] = marked[block_count] = at++;
+    end[block_count++] = at;
+  }
+  for (size_t b = 0; b < block_count; ++b) {
+    for (size_t c = 0; c < k; ++c) {
+      work[work_count++] = b*k + c;
+      in_work[b*k + c] = true;
+    }
+  }
+
+  while (work_count > 0) {
+    size_t item = work[--work_count];
+    in_work[item] = false;
+    size_t b = item / k, c = item % k;
+
+    size_t splitter_count = end[b] - first[b];
+    memcpy(splitter, &elems[first[b]], sizeof(*splitter) * splitter_count);
+    size_t touched_count = 0;
+    for (size_t i = 0; i < splitter_count; ++i) {
+      size_t node = splitter[i];
+      for (size_t j = inv_start[c*N + node]; j < inv_start[c*N + node + 1]; ++j) {
+        fsm_state_t p = inv[j];
+        size_t pb = block[p];
+        if (pos[p] < marked[pb]) continue;
+        if (marked[pb] == first[pb]) touched[touched_count++] = pb;
+        fsm_state_t other = elems[marked[pb]];
+        elems[pos[p]] = other;
+        pos[other] = pos[p];
+        elems[marked[pb]] = p;
+        pos[p] = marked[pb]++;
+      }
+    }
+
+    for (size_t i = 0; i < touched_count; ++i) {
+      size_t tb = touched[i];
+      size_t mid = marked[tb];
+      marked[tb] = first[tb];
+      if (mid == end[tb]) continue;
+
+      // The smaller half moves into the new block
+      size_t nb = block_count++;
+      if (mid - first[tb] <= end[tb] - mid) {
+        first[nb] = first[tb];
+        end[nb] = mid;
+        first[tb] = mid;
+      } else {
+        first[nb] = mid;
+        end[nb] = end[tb];
+        end[tb] = mid;
+      }
+      marked[nb] = first[nb];
+      marked[tb] = first[tb];
+      for (size_t j = first[nb]; j < end[nb]; ++j) block[elems[j]] = nb;
+
+      for (size_t a = 0; a < k; ++a) {
+        if (in_work[nb*k + a]) continue;
+        in_work[nb*k + a] = true;
+        work[work_count++] = nb*k + a;
+      }
+    }
+  }
+
+  // Number blocks by their lowest state and emit one row per block
+  for (size_t b = 0; b < block_count; ++b) number[b] = SIZE_MAX;
+  size_t new_count = 0;
+  for (size_t s = 0; s < n; ++s) {
+    if (reachable[s] && number[block[s]] == SIZE_MAX) number[block[s]] = new_count++;
+  }
+  if (!fsm_reserve(&result, new_count)) goto done;
+  for (size_t s = 0; s < n; ++s) {
+    if (!reachable[s] || number[block[s]] != result.count) continue;
+    fsm_state_t state = fsm_push_empty(&result);
+    for (fsm_event_t e = 0; e < fsm.event_count; ++e) {
+      fsm_state_t t = fsm_get(fsm, s, e);
+      fsm_set(&result, state, e, t < n ? (fsm_state_t)number[block[t]] : (fsm_state_t)(new_count + (t - n)));
+    }
+    fsm_set_accepting(&result, state, fsm_is_accepting(fsm, s));
+  }
+  if (fsm.dead < n && reachable[fsm.dead]) fsm_set_dead(&result, (fsm_state_t)number[block[fsm.dead]]);
+  result.state = (fsm_state_t)number[block[fsm.state]];
+  for (size_t s = 0; remap && s < n; ++s) remap[s] = reachable[s] ? (fsm_state_t)number[block[s]] : FSM_NO_STATE;
+  *min = result;
+  ok = true;
+
+done:
+  if (!ok && result.items) fsm_free(result);
+  free(queue);
+  free(reachable);
+  free(fill);
+  free(number);
+  free(exits);
+  free(inv_start);
+  free(inv);
+  free(targets);
+  free(elems);
+  free(splitter);
+  free(pos);
+  free(block);
+  free(first);
+  free(end);
+  free(marked);
+  free(touched);
+  free(work);
+  free(in_work);
+  return ok;
+}
+
+typedef struct {
+  uint64_t visits;
+  size_t rank;
+  fsm_state_t state;
+} fsm__hotness_t;
+
+int fsm__compare_hotness(const void *a, const void *b) {
+  const fsm__hotness_t *x = a, *y = b;
+  if (x->visits != y->visits) return x->visits < y->visits ? 1 : -1;
+  return (x->rank > y->rank) - (x->rank < y->rank);
+}
+
+// Renumbers the states so the rows that are read together sit together.
+// The base order is breadth-first from fsm->state (then from every state
+// not reached yet), so a state's successors follow it closely. With
+// `visits` (one count per state, fsm_profile_t's visits fit) the states are
+// then sorted hottest first, ties kept in that order. The dead state goes
+// last either way, runs never read its row.
+//
+// Every cell, the accept bits, the shuffle rows, fsm->state and fsm->dead
+// are rewritten; exit targets (>= fsm->count) stay as they are and so does
+// the layout. Fills remap[old] = new when `remap` is not NULL. Returns false
+// and leaves the table untouched if memory runs out.
+bool fsm_reorder(fsm_t *fsm, const uint64_t *visits, fsm_state_t *remap) {
+  assert(fsm);
+  size_t n = fsm->count, k = fsm->class_count;
+  if (n == 0) return true;
+  fsm__hotness_t *order = malloc(sizeof(*order) * (n + 1));
+  fsm_state_t *number = malloc(sizeof(*number) * (n + 1));
+  uint8_t *items = fsm__alloc(fsm->allocator, fsm->block_size);
+  if (!order || !number || !items) {
+    free(order);
+    free(number);
+    fsm__free(fsm->allocator, items, fsm->block_size);
+    return false;
+  }
+
+  // `number` marks queued states until it is overwritten with the result
+  for (size_t s = 0; s < n; ++s) number[s] = FSM_NO_STATE;
+  size_t queued = 0;
+  for (size_t i = 0; i <= n; ++i) {
+    size_t seed = i == 0 ? fsm->state : i - 1;
+    if (seed >= n || seed == fsm->dead || number[seed] != FSM_NO_STATE) continue;
+    size_t head = queued;
+    number[seed] = 0;
+    order[queued++].state = (fsm_state_t)seed;
+    while (head < queued) {
+      fsm_state_t s = order[head++].state;
+      for (size_t c = 0; c < k; ++c) {
+        fsm_state_t t = fsm__cell(*fsm, (size_t)s*k + c);
+        if (t >= n || t == fsm->dead || number[t] != FSM_NO_STATE) continue;
+        number[t] = 0;
+        order[queued++].state = t;
+      }
+    }
+  }
+  for (size_t i = 0; i < queued; ++i) {
+    order[i].rank = i;
+    order[i].visits = visits ? visits[order[i].state] : 0;
+  }
+  if (visits) qsort(order, queued, sizeof(*order), fsm__compare_hotness);
+  if (fsm->dead < n) order[queued++].state = fsm->dead;
+  assert(queued == n);
+  for (size_t i = 0; i < n; ++i) number[order[i].state] = (fsm_state_t)i;
+
+  // Same block, same offsets: copy it for the class map and padding, then
+  // rewrite what depends on state numbers
+  uint8_t *old = fsm->items;
+  memcpy(items, old, fsm->block_size);
+  uint64_t *accept = (uint64_t*)(items + ((uint8_t*)fsm->accept - old));
+  memset(accept, 0, sizeof(uint64_t) * fsm__accept_words(n));
+  for (size_t s = 0; s < n; ++s) {
+    size_t row = (size_t)number[s] * k;
+    for (size_t c = 0; c < k; ++c) {
+      fsm_state_t t = fsm__cell(*fsm, s*k + c);
+      if (t < n) t = number[t];
+      switch (fsm->cell_size) {
+      case 1:  ((uint8_t*)items)[row + c] = (uint8_t)t; break;
+      case 2:  ((uint16_t*)items)[row + c] = (uint16_t)t; break;
+      default: ((fsm_state_t*)items)[row + c] = t; break;
+      }
+    }
+    if (FSM__ACCEPTING(fsm->accept, s)) accept[number[s]/64] |= 1ULL << number[s]%64;
+  }
+  if (remap) memcpy(remap, number, sizeof(*number) * n);
+
+  fsm_t reordered = *fsm;
+  reordered.items = items;
+  reordered.accept = accept;
+  reordered.classes = fsm->classes ? items + (fsm->classes - old) : NULL;
+  reordered.shuffle = fsm->shuffle ? items + (fsm->shuffle - old) : NULL;
+  reordered.mapping = NULL;
+  reordered.mapping_size = 0;
+  if (fsm->state < n) reordered.state = number[fsm->state];
+  if (fsm->dead < n) reordered.dead = number[fsm->dead];
+  fsm__fill_shuffle(reordered);
+  fsm__release(*fsm);
+  *fsm = reordered;
+  free(order);
+  free(number);
+  return true;
 }
 
 void fsm_dump(fsm_t fsm) {
@@ -91,14 +1521,408 @@ void fsm_dump(fsm_t fsm) {
   }
 }
 
+// Events outside the alphabet lead to the dead state, or keep the state
+// when there is none
+void fsm__emit_step_guard(fsm_t fsm, FILE *out) {
+  if (fsm.dead != FSM_NO_STATE) fprintf(out, "  if (event >= %zu) return %u;\n", fsm.event_count, fsm.dead);
+  else fprintf(out, "  if (event >= %zu) return state;\n", fsm.event_count);
+}
+
+// Writes a standalone C translation of the machine: `<name>_step`,
+// `<name>_accepting` and `<name>_run` (same stopping rules as
+// fsm_run_bytes) plus `<NAME>_START`, which is fsm.state. FSM_EMIT_TABLE
+// bakes the cells into static const arrays, FSM_EMIT_SWITCH into nested
+// switches with the most common target of each state as the default.
+// Both keep states outside the table and guard events outside the alphabet.
+// Returns false, having written nothing, if `name` is not a C identifier
+// or the switch scratch cannot be allocated.
+bool fsm_emit_c(fsm_t fsm, FILE *out, const char *name, fsm_emit_t mode) {
+  assert(out && name);
+  if (*name == '\0') return false;
+  for (const char *c = name; *c; ++c) {
+    bool letter = (*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') || *c == '_';
+    if (!letter && (c == name || *c < '0' || *c > '9')) return false;
+  }
+  size_t scratch_size = (sizeof(fsm_state_t) + sizeof(size_t)) * (fsm.event_count + 1);
+  uint8_t *scratch = NULL;
+  if (mode == FSM_EMIT_SWITCH) {
+    scratch = fsm__alloc(fsm.allocator, scratch_size);
+    if (!scratch) return false;
+  }
+  fsm_state_t max = fsm.state;
+  for (size_t s = 0; s < fsm.count; ++s) {
+    for (size_t e = 0; e < fsm.event_count; ++e) {
+      fsm_state_t t = fsm_get(fsm, s, e);
+      if (t > max) max = t;
+    }
+  }
+  const char *state_t = max <= UINT8_MAX ? "uint8_t" : max <= UINT16_MAX ? "uint16_t" : "uint32_t";
+
+  fprintf(out, "// Generated by fsm_emit_c, do not edit\n");
+  fprintf(out, "#include <stddef.h>\n#include <stdint.h>\n#include <stdbool.h>\n\n");
+  fprintf(out, "#define ");
+  for (const char *c = name; *c; ++c) fputc(*c >= 'a' && *c <= 'z' ? *c - 'a' + 'A' : *c, out);
+  fprintf(out, "_START %u\n\n", fsm.state);
+
+  size_t accept_bytes = fsm.count > 0 ? (fsm.count + 7)/8 : 1;
+  fprintf(out, "static const uint8_t %s_accept[%zu] = {", name, accept_bytes);
+  for (size_t i = 0; i < accept_bytes; ++i) {
+    uint8_t bits = 0;
+    for (size_t j = 0; j < 8 && i*8 + j < fsm.count; ++j) {
+      if (fsm_is_accepting(fsm, i*8 + j)) bits |= 1 << j;
+    }
+    fprintf(out, "%s0x%02x", i > 0 ? ", " : "", bits);
+  }
+  fprintf(out, "};\n\n");
+  fprintf(out, "static inline bool %s_accepting(uint32_t state) {\n", name);
+  fprintf(out, "  return state < %zu && (%s_accept[state/8] >> (state%%8) & 1);\n}\n\n", fsm.count, name);
+
+  if (mode == FSM_EMIT_TABLE) {
+    if (fsm.classes) {
+      fprintf(out, "static const uint8_t %s_classes[256] = {", name);
+      for (size_t e = 0; e < FSM_MAX_CLASSES; ++e) fprintf(out, "%s%s%u", e > 0 ? "," : "", e % 16 == 0 ? "\n  " : " ", fsm.classes[e]);
+      fprintf(out, "\n};\n\n");
+    }
+    fprintf(out, "static const %s %s_table[%zu][%zu] = {\n", state_t, name,
+            fsm.count > 0 ? fsm.count : 1, fsm.class_count > 0 ? fsm.class_count : 1);
+    for (size_t s = 0; s < fsm.count; ++s) {
+      fprintf(out, "  {");
+      for (size_t c = 0; c < fsm.class_count; ++c) fprintf(out, "%s%u", c > 0 ? ", " : "", fsm__cell(fsm, s*fsm.class_count + c));
+      fprintf(out, "},\n");
+    }
+    fprintf(out, "%s};\n\n", fsm.count > 0 ? "" : "  {0},\n");
+    fprintf(out, "static inline uint32_t %s_step(uint32_t state, uint32_t event) {\n", name);
+    fsm__emit_step_guard(fsm, out);
+    fprintf(out, "  if (state >= %zu) return state;\n", fsm.count);
+    if (fsm.classes) fprintf(out, "  return %s_table[state][%s_classes[event]];\n}\n\n", name, name);
+    else fprintf(out, "  return %s_table[state][event];\n}\n\n", name);
+  } else {
+    fprintf(out, "static inline uint32_t %s_step(uint32_t state, uint32_t event) {\n", name);
+    fsm__emit_step_guard(fsm, out);
+    fprintf(out, "  switch (state) {\n");
+    size_t *uses = (size_t*)scratch;
+    fsm_state_t *targets = (fsm_state_t*)(uses + fsm.event_count + 1);
+    for (size_t s = 0; s < fsm.count; ++s) {
+      // Pick the target shared by the most events as the default
+      size_t distinct = 0, best = 0;
+      for (size_t e = 0; e < fsm.event_count; ++e) {
+        fsm_state_t t = fsm_get(fsm, s, e);
+        size_t i = 0;
+        while (i < distinct && targets[i] != t) ++i;
+        if (i == distinct) {
+          targets[distinct] = t;
+          uses[distinct++] = 0;
+        }
+        if (++uses[i] > uses[best]) best = i;
+      }
+      fprintf(out, "  case %zu:\n", s);
+      if (distinct <= 1) {
+        fprintf(out, "    return %u;\n", distinct ? targets[0] : 0);
+        continue;
+      }
+      fprintf(out, "    switch (event) {\n");
+      for (size_t i = 0; i < distinct; ++i) {
+        if (i == best) continue;
+        fprintf(out, "   ");
+        for (size_t e = 0; e < fsm.event_count; ++e) {
+          if (fsm_get(fsm, s, e) == targets[i]) fprintf(out, " case %zu:", e);
+        }
+        fprintf(out, " return %u;\n", targets[i]);
+      }
+      fprintf(out, "    default: return %u;\n    }\n", targets[best]);
+    }
+    fsm__free(fsm.allocator, scratch, scratch_size);
+    fprintf(out, "  default: return state;\n  }\n}\n\n");
+  }
+
+  fprintf(out, "// Returns the number of bytes consumed and leaves the last state in *state\n");
+  fprintf(out, "static inline size_t %s_run(uint32_t *state, const uint8_t *bytes, size_t n) {\n", name);
+  fprintf(out, "  uint32_t s = *state;\n  size_t i = 0;\n");
+  fprintf(out, "  for (; i < n && s < %zu", fsm.count);
+  if (fsm.dead != FSM_NO_STATE) fprintf(out, " && s != %u", fsm.dead);
+  fprintf(out, "; ++i) s = %s_step(s, bytes[i]);\n", name);
+  fprintf(out, "  *state = s;\n  return i;\n}\n");
+  return true;
+}
+
+// On-disk header, followed at FSM_FILE_HEADER_SIZE by the frozen block
+// exactly as fsm__reencode lays it out, so fsm_map can point into it.
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t start;
+  uint32_t dead;
+  uint8_t cell_size;
+  uint8_t has_classes;
+  uint8_t shuffle_width;
+  uint8_t reserved;
+  uint64_t event_count;
+  uint64_t count;
+  uint64_t class_count;
+  uint64_t block_size;
+  uint64_t checksum;
+} fsm__file_header_t;
+
+// The header is part of the file format, this fails to compile if it moves
+typedef char fsm__file_header_size_check[sizeof(fsm__file_header_t) == 64 && sizeof(fsm__file_header_t) <= FSM_FILE_HEADER_SIZE ? 1 : -1];
+
+uint64_t fsm__fnv1a(uint64_t hash, const void *data, size_t size) {
+  const uint8_t *bytes = data;
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= bytes[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+// Streams the canonical frozen block of `fsm` into `out` (if any) and
+// returns its checksum. Works for mutable tables too: their first `count`
+// rows and accept words are already contiguous.
+uint64_t fsm__write_block(fsm_t fsm, fsm__layout_t layout, FILE *out, bool *ok) {
+  static const uint8_t zeros[FSM_ALIGNMENT] = {0};
+  uint64_t hash = 14695981039346656037ULL;
+  struct { const void *data; size_t size, offset; } sections[] = {
+    { fsm.items, fsm.cell_size * fsm.count * fsm.class_count, 0 },
+    { fsm.accept, sizeof(uint64_t) * fsm__accept_words(fsm.count), layout.accept },
+    { fsm.classes, fsm.classes ? FSM_MAX_CLASSES : 0, layout.classes },
+    { fsm.shuffle, fsm.shuffle ? 256*(size_t)fsm.shuffle_width : 0, layout.shuffle },
+  };
+  size_t at = 0;
+  for (size_t i = 0; i < sizeof(sections)/sizeof(sections[0]); ++i) {
+    if (sections[i].size == 0) continue;
+    while (at < sections[i].offset) {
+      size_t pad = sections[i].offset - at < FSM_ALIGNMENT ? sections[i].offset - at : FSM_ALIGNMENT;
+      hash = fsm__fnv1a(hash, zeros, pad);
+      if (out && fwrite(zeros, 1, pad, out) != pad) *ok = false;
+      at += pad;
+    }
+    hash = fsm__fnv1a(hash, sections[i].data, sections[i].size);
+    if (out && fwrite(sections[i].data, 1, sections[i].size, out) != sections[i].size) *ok = false;
+    at += sections[i].size;
+  }
+  while (at < layout.size) {
+    size_t pad = layout.size - at < FSM_ALIGNMENT ? layout.size - at : FSM_ALIGNMENT;
+    hash = fsm__fnv1a(hash, zeros, pad);
+    if (out && fwrite(zeros, 1, pad, out) != pad) *ok = false;
+    at += pad;
+  }
+  return hash;
+}
+
+// Writes `fsm` (with fsm.state as the start state) in the versioned binary
+// format that fsm_map loads. Returns false on I/O errors.
+bool fsm_save(fsm_t fsm, const char *path) {
+  assert(path);
+  fsm__layout_t layout = fsm__frozen_layout(fsm.count, fsm.class_count, fsm.cell_size,
+                                            fsm.classes != NULL, fsm.shuffle ? fsm.shuffle_width : 0);
+  fsm__file_header_t header = {
+    .magic = FSM_FILE_MAGIC,
+    .version = FSM_FILE_VERSION,
+    .byte_order = 0x01020304,
+    .start = fsm.state,
+    .dead = fsm.dead,
+    .cell_size = fsm.cell_size,
+    .has_classes = fsm.classes != NULL,
+    .shuffle_width = fsm.shuffle ? fsm.shuffle_width : 0,
+    .event_count = fsm.event_count,
+    .count = fsm.count,
+    .class_count = fsm.class_count,
+    .block_size = layout.size,
+  };
+  bool ok = true;
+  header.checksum = fsm__write_block(fsm, layout, NULL, &ok);
+
+  FILE *out = fopen(path, "wb");
+  if (!out) return false;
+  uint8_t padded[FSM_FILE_HEADER_SIZE] = {0};
+  memcpy(padded, &header, sizeof(header));
+  if (fwrite(padded, 1, sizeof(padded), out) != sizeof(padded)) ok = false;
+  fsm__write_block(fsm, layout, out, &ok);
+  if (fclose(out) != 0) ok = false;
+  return ok;
+}
+
+// Points `fsm` at a file written by fsm_save. The table is mmap'd read-only
+// and shared with every other process mapping the same file; nothing is
+// copied. Without mmap (FSM_NO_MMAP, implied on _WIN32) the block is read
+// into memory instead. The header and checksum are verified, on any
+// mismatch `fsm` is left untouched and false is returned.
+bool fsm_map(fsm_t *fsm, const char *path) {
+  assert(fsm && path);
+  fsm__file_header_t header;
+  uint8_t *block = NULL;
+  void *mapping = NULL;
+  size_t mapping_size = 0;
+
+#ifdef FSM_NO_MMAP
+  FILE *in = fopen(path, "rb");
+  if (!in) return false;
+  uint8_t padded[FSM_FILE_HEADER_SIZE];
+  if (fread(padded, 1, sizeof(padded), in) != sizeof(padded)) {
+    fclose(in);
+    return false;
+  }
+  memcpy(&header, padded, sizeof(header));
+  if (memcmp(header.magic, FSM_FILE_MAGIC, 4) != 0 || header.block_size > SIZE_MAX - FSM_ALIGNMENT) {
+    fclose(in);
+    return false;
+  }
+  block = fsm__alloc(NULL, header.block_size);
+  if (!block || fread(block, 1, header.block_size, in) != header.block_size) {
+    fsm__free(NULL, block, header.block_size);
+    fclose(in);
+    return false;
+  }
+  fclose(in);
+#else
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < FSM_FILE_HEADER_SIZE) {
+    close(fd);
+    return false;
+  }
+  mapping_size = st.st_size;
+  mapping = mmap(NULL, mapping_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) return false;
+  memcpy(&header, mapping, sizeof(header));
+  block = (uint8_t*)mapping + FSM_FILE_HEADER_SIZE;
+  if (header.block_size != mapping_size - FSM_FILE_HEADER_SIZE) {
+    munmap(mapping, mapping_size);
+    return false;
+  }
+#endif
+
+  // The checksum only catches corruption, so everything the layout and the
+  // runners index with is checked too. Sizes keep half of size_t as room
+  // for the accept bits, class map and shuffle rows added after the cells.
+  bool valid = memcmp(header.magic, FSM_FILE_MAGIC, 4) == 0
+            && header.version == FSM_FILE_VERSION
+            && header.byte_order == 0x01020304
+            && (header.cell_size == 1 || header.cell_size == 2 || header.cell_size == 4)
+            && (header.has_classes ? header.class_count <= FSM_MAX_CLASSES && header.event_count <= FSM_MAX_CLASSES
+                                   : header.class_count == header.event_count)
+            && (header.shuffle_width == 0 || header.shuffle_width == 16 || header.shuffle_width == 64)
+            && (header.shuffle_width == 0 || header.count <= header.shuffle_width)
+            && header.count < FSM_NO_STATE
+            && header.class_count <= SIZE_MAX/2
+            && (header.class_count == 0 || header.count <= SIZE_MAX/2 / header.cell_size / header.class_count);
+  fsm__layout_t layout = {0};
+  if (valid) {
+    layout = fsm__frozen_layout(header.count, header.class_count, header.cell_size,
+                                header.has_classes, header.shuffle_width);
+    valid = layout.size == header.block_size
+         && fsm__fnv1a(14695981039346656037ULL, block, header.block_size) == header.checksum;
+  }
+  for (size_t e = 0; valid && header.has_classes && e < header.event_count; ++e) {
+    valid = block[layout.classes + e] < header.class_count;
+  }
+  if (!valid) {
+#ifdef FSM_NO_MMAP
+    fsm__free(NULL, block, header.block_size);
+#else
+    munmap(mapping, mapping_size);
+#endif
+    return false;
+  }
+
+  fsm_t mapped = {0};
+  mapped.state = header.start;
+  mapped.event_count = header.event_count;
+  mapped.items = block;
+  mapped.capacity = header.count;
+  mapped.count = header.count;
+  mapped.cell_size = header.cell_size;
+  mapped.frozen = true;
+  mapped.classes = header.has_classes ? block + layout.classes : NULL;
+  mapped.class_count = header.class_count;
+  mapped.accept = (uint64_t*)(block + layout.accept);
+  mapped.dead = header.dead;
+#ifdef FSM__X86_SIMD
+  mapped.shuffle = header.shuffle_width ? block + layout.shuffle : NULL;
+  mapped.shuffle_width = header.shuffle_width;
+#endif
+  mapped.mapping = mapping;
+  mapped.mapping_size = mapping_size;
+  mapped.block_size = header.block_size;
+  *fsm = mapped;
+  return true;
+}
+
 void fsm_free(fsm_t fsm) {
   assert(fsm.items);
-  for (size_t i = 0; i < fsm.count; ++i) {
-    free(fsm.items[i]);
+  fsm__release(fsm);
+}
+
+#ifdef FSM_PROFILE
+bool fsm_profile_init(fsm_profile_t *profile, fsm_t fsm) {
+  assert(profile);
+  size_t cells = fsm.count * fsm.class_count;
+  profile->items = fsm.items;
+  profile->state_count = fsm.count;
+  profile->class_count = fsm.class_count;
+  profile->visits = calloc(fsm.count > 0 ? fsm.count : 1, sizeof(*profile->visits));
+  profile->transitions = calloc(cells > 0 ? cells : 1, sizeof(*profile->transitions));
+  if (profile->visits && profile->transitions) return true;
+  free(profile->visits);
+  free(profile->transitions);
+  memset(profile, 0, sizeof(*profile));
+  return false;
+}
+
+// Counters are per thread: each thread attaches its own profile (NULL
+// detaches) and they are merged once the threads are done. Returns the
+// profile that was attached before.
+fsm_profile_t *fsm_profile_attach(fsm_profile_t *profile) {
+  fsm_profile_t *previous = fsm__profile;
+  fsm__profile = profile;
+  return previous;
+}
+
+void fsm_profile_reset(fsm_profile_t *profile) {
+  assert(profile);
+  memset(profile->visits, 0, sizeof(*profile->visits) * profile->state_count);
+  memset(profile->transitions, 0, sizeof(*profile->transitions) * profile->state_count * profile->class_count);
+}
+
+// Only profiles of the same table can be merged
+bool fsm_profile_merge(fsm_profile_t *into, const fsm_profile_t *from) {
+  assert(into && from);
+  if (into->items != from->items) return false;
+  if (into->state_count != from->state_count || into->class_count != from->class_count) return false;
+  for (size_t s = 0; s < into->state_count; ++s) into->visits[s] += from->visits[s];
+  size_t cells = into->state_count * into->class_count;
+  for (size_t c = 0; c < cells; ++c) into->transitions[c] += from->transitions[c];
+  return true;
+}
+
+// One record per line, counters that stayed at zero are left out:
+//   profile <states> <classes>
+//   state <state> <visits>
+//   edge <state> <class> <target> <hits>
+void fsm_profile_dump(fsm_t fsm, const fsm_profile_t *profile, FILE *out) {
+  assert(profile && out);
+  assert(profile->state_count == fsm.count && profile->class_count == fsm.class_count);
+  fprintf(out, "profile %zu %zu\n", profile->state_count, profile->class_count);
+  for (size_t s = 0; s < profile->state_count; ++s) {
+    if (profile->visits[s] == 0) continue;
+    fprintf(out, "state %zu %llu\n", s, (unsigned long long)profile->visits[s]);
+    for (size_t c = 0; c < profile->class_count; ++c) {
+      size_t cell = s*profile->class_count + c;
+      if (profile->transitions[cell] == 0) continue;
+      fprintf(out, "edge %zu %zu %u %llu\n", s, c, fsm__cell(fsm, cell), (unsigned long long)profile->transitions[cell]);
+    }
   }
-  free(fsm.items);
 }
 
+void fsm_profile_free(fsm_profile_t profile) {
+  free(profile.visits);
+  free(profile.transitions);
+}
+#endif // FSM_PROFILE
+
 #endif // FSM_IMPLEMENTATION
 
 #endif // FSM_H_
\ No newline at end of file
@@ -5,7 +5,8 @@
 
 #define CC "gcc"
 #define CFLAGS "-Wall", "-Wextra", "-Wpedantic", "-Werror", "-ggdb", "-std=c99", "-I./include"
-#define LDFLAGS ""
+#define LDFLAGS "-lpthread"
+#define BENCH_CFLAGS "-Wall", "-Wextra", "-Wpedantic", "-Werror", "-O2", "-std=c99", "-I./include"
 
 typedef struct {
   const char *source_path;
@@ -21,6 +22,18 @@ example_t examples[] = {
     .source_path = "./examples/regex.c",
     .exe_path = "./build/regex",
   },
+  (example_t){
+    .source_path = "./examples/aho_corasick.c",
+    .exe_path = "./build/aho_corasick",
+  },
+  (example_t){
+    .source_path = "./examples/tables.c",
+    .exe_path = "./build/tables",
+  },
+  (example_t){
+    .source_path = "./examples/profile.c",
+    .exe_path = "./build/profile",
+  },
   // (example_t){
   //   .source_path = ,
   //   .exe_path = ,
@@ -29,7 +42,8 @@ example_t examples[] = {
 
 bool build(const char *src_path, const char *exe_path) {
   Nob_Cmd cmd = {0};
-  nob_cmd_append(&cmd, CC, CFLAGS, "-o", exe_path, src_path, LDFLAGS);
+  nob_cmd_append(&cmd, CC, CFLAGS, "-o", exe_path, src_path);
+  if (strlen(LDFLAGS) > 0) nob_cmd_append(&cmd, LDFLAGS);
   return nob_cmd_run_sync(cmd);
 }
 
@@ -42,10 +56,25 @@ bool build_examples() {
   return true;
 }
 
+// ./nob bench [filter] [megabytes] builds the benchmarks with optimizations
+// on and runs them, passing the arguments through
+bool run_bench(int argc, char **argv) {
+  Nob_Cmd cmd = {0};
+  nob_cmd_append(&cmd, CC, BENCH_CFLAGS, "-o", "./build/bench", "./bench/bench.c");
+  if (strlen(LDFLAGS) > 0) nob_cmd_append(&cmd, LDFLAGS);
+  if (!nob_cmd_run_sync(cmd)) return false;
+
+  cmd.count = 0;
+  nob_cmd_append(&cmd, "./build/bench");
+  for (int i = 0; i < argc; ++i) nob_cmd_append(&cmd, argv[i]);
+  return nob_cmd_run_sync(cmd);
+}
+
 int main(int argc, char **argv) {
   NOB_GO_REBUILD_URSELF(argc, argv);
 
   if (!nob_mkdir_if_not_exists("build")) return 1;
+  if (argc > 1 && strcmp(argv[1], "bench") == 0) return run_bench(argc - 2, argv + 2) ? 0 : 1;
   if (!build_examples()) return 1;
 
   return 0;